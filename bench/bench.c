@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Resident set size in bytes, or 0 if it cannot be determined. */
+static unsigned long current_rss(void) {
+  unsigned long size, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+
+  if (!statm) return 0;
+  if (2 != fscanf(statm, "%lu %lu", &size, &resident))
+    resident = 0;
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Peak resident set size in KiB. */
+static long peak_rss(void) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+int bench_main(int argc, char** argv, const bench_protocol* prot) {
+  unsigned long max = 10000000, target, nodes, leaves, before, after;
+  double start, built, traversed, dumped, destroyed;
+  void* context, * root;
+  FILE* devnull;
+
+  if (argc > 2 || (argc == 2 && !(max = strtoul(argv[1], NULL, 10)))) {
+    fprintf(stderr, "Usage: %s [max-nodes]\n", argv[0]);
+    return 2;
+  }
+
+  devnull = fopen("/dev/null", "w");
+  if (!devnull) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  printf("%-8s %9s %12s %12s %12s %12s %10s %10s\n",
+         "protocol", "nodes", "build/s", "traverse/s", "graphviz/s",
+         "destroy/s", "bytes/node", "peak KiB");
+  for (target = 10000; target <= max; target *= 10) {
+    before = current_rss();
+    context = (*prot->create)();
+    start = now();
+    nodes = (*prot->build)(context, target, &root);
+    built = now();
+    after = current_rss();
+    leaves = (*prot->traverse)(root);
+    traversed = now();
+    fprintf(devnull, "digraph {\n");
+    (*prot->dump)(root, devnull);
+    fprintf(devnull, "}\n");
+    dumped = now();
+    (*prot->destroy)(context);
+    destroyed = now();
+
+    if (!leaves) {
+      fprintf(stderr, "%s: traversal found no leaves\n", prot->name);
+      return 1;
+    }
+
+    printf("%-8s %9lu %12.4g %12.4g %12.4g %12.4g %10.1f %10ld\n",
+           prot->name, nodes,
+           nodes / (built - start),
+           nodes / (traversed - built),
+           nodes / (dumped - traversed),
+           nodes / (destroyed - dumped),
+           after > before? (double)(after - before) / nodes : 0.0,
+           peak_rss());
+    fflush(stdout);
+  }
+
+  fclose(devnull);
+  return 0;
+}
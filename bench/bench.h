@@ -0,0 +1,54 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+
+/* The operations measured on one generated protocol. The context and root
+ * are passed around untyped so that the driver need not know the protocol.
+ */
+typedef struct {
+  const char* name;
+  void* (*create)(void);
+  /* Builds a tree of about nodes elements, returning how many it made */
+  unsigned long (*build)(void* context, unsigned long nodes, void** root);
+  /* Visits the whole tree, returning the number of leaves seen */
+  unsigned long (*traverse)(void* root);
+  void (*dump)(void* root, FILE* out);
+  void (*destroy)(void* context);
+} bench_protocol;
+
+/* Runs the benchmark over 10^4 up to the maximum number of nodes (10^7 by
+ * default, or argv[1]), printing one line per size.
+ */
+int bench_main(int argc, char** argv, const bench_protocol* prot);
+
+#endif /* BENCH_H_ */
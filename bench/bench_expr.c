@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "expr.h"
+#include "bench.h"
+
+static const YYLTYPE where;
+
+void num_walk(num_t* this, unsigned long* leaves) {
+  ++*leaves;
+}
+
+/* Builds a balanced tree of binary operators over n nodes, with a negation
+ * wherever n is a multiple of five.
+ */
+static expr* build_expr(expr_CONTEXT_T* context, unsigned long n) {
+  if (n <= 1)
+    return num_in(context, where, (long)n);
+  if (n % 5 == 0 || n == 2)
+    return neg_in(context, where, build_expr(context, n-1));
+  return binop_in(context, where, "+-*/"[n & 3],
+                  build_expr(context, (n-1) / 2),
+                  build_expr(context, n-1 - (n-1) / 2));
+}
+
+static void* create(void) {
+  return expr_create_context();
+}
+
+static unsigned long build(void* context, unsigned long nodes, void** root) {
+  *root = build_expr(context, nodes);
+  return nodes;
+}
+
+static unsigned long traverse(void* root) {
+  unsigned long leaves = 0;
+  walk(root, &leaves);
+  return leaves;
+}
+
+static void dump_tree(void* root, FILE* out) {
+  dump(root, out);
+}
+
+static void destroy(void* context) {
+  expr_destroy_context(context);
+}
+
+int main(int argc, char** argv) {
+  static const bench_protocol prot = {
+    "expr", create, build, traverse, dump_tree, destroy
+  };
+  return bench_main(argc, argv, &prot);
+}
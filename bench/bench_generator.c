@@ -0,0 +1,302 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <yaml.h>
+
+#include "reader.h"
+#include "data.h"
+#include "profile.h"
+#include "output.h"
+
+/* More doublings than this overflow the shapes long before they finish */
+#define MAX_STEPS 16
+
+/* The shape of one synthesised protocol definition. With options set, the
+ * protocol also enables the optional features which add generator passes,
+ * and is generated against a synthesised dispatch profile.
+ */
+typedef struct {
+  unsigned elements, methods, fields, depth;
+  int options;
+} shape;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Writes a protocol with the given shape. The methods cycle through the
+  common kinds of automatic implementation, and each element overrides one of
+  them. Every depth-th element starts a new chain of elements each extending
+  the one before, so inherited fields accumulate along the chain. With
+  options, every other element is interned.
+ */
+static void synthesise(FILE* out, const shape* s, const char* profile) {
+  static const char* const field_types[] = {
+    "int", "long", "const char*", "gen*", "gen*[]"
+  };
+  static const char* const overrides[] = {
+    "do nothing", "return 1", "do nothing", "return 1"
+  };
+  unsigned e, m, f;
+
+  fprintf(out,
+          "configuration:\n"
+          "  protocol_name: gen\n");
+  if (s->options)
+    fprintf(out,
+            "  snapshot: yes\n"
+            "  concurrent: yes\n"
+            "  recording: yes\n"
+            "  profile: %s\n",
+            profile);
+  fprintf(out,
+          "definitions: |\n"
+          "  #include <stdio.h>\n"
+          "  typedef struct { int first_line, first_column; } YYLTYPE;\n"
+          "protocol:\n"
+          "  dump:\n"
+          "    out: FILE*\n"
+          "    default: graphviz\n"
+          "  hash:\n"
+          "    return: unsigned long\n"
+          "    default: structural hash\n");
+  for (m = 0; m < s->methods; ++m) {
+    fprintf(out, "  m%u:\n", m);
+    switch (m % 4) {
+    case 0:
+      fprintf(out, "    x: int\n    default: recursive\n");
+      break;
+    case 1:
+      fprintf(out, "    return: int\n    default: return 0\n");
+      break;
+    case 2:
+      fprintf(out, "    out: FILE*\n    default: do nothing\n");
+      break;
+    case 3:
+      fprintf(out, "    return: int\n    x: long\n    default: custom\n");
+      break;
+    }
+  }
+
+  for (e = 0; e < s->elements; ++e) {
+    fprintf(out, "e%u:\n", e);
+    if (e % s->depth)
+      fprintf(out, "  extends: [e%u]\n", e-1);
+    if (s->options && e % 2)
+      fprintf(out, "  interned: yes\n");
+    fprintf(out, "  fields:\n");
+    for (f = 0; f < s->fields; ++f)
+      fprintf(out, "    f%u_%u: %s\n", e, f, field_types[(e+f) % 5]);
+    if (s->methods)
+      fprintf(out, "  methods:\n    m%u: %s\n",
+              e % s->methods, overrides[e % s->methods % 4]);
+  }
+}
+
+/*
+  Writes a dispatch profile for the shape into a new file, whose name is
+  stored into the template. Every element calls every method, with a few
+  calls missing so that some implementations are cold, and each element
+  dominates one of the methods.
+ */
+static void synthesise_profile(char* filename, const shape* s) {
+  static const char* const named_methods[] = { "dump", "hash" };
+  int fd = mkstemp(filename);
+  FILE* out = fd < 0? NULL : fdopen(fd, "w");
+  unsigned e, m;
+
+  if (!out) {
+    perror(filename);
+    exit(EX_OSERR);
+  }
+
+  for (e = 0; e < s->elements; ++e) {
+    for (m = 0; m < 2; ++m)
+      fprintf(out, "e%u %s %u 0\n", e, named_methods[m], (e + m) % 8);
+    for (m = 0; m < s->methods; ++m)
+      fprintf(out, "e%u m%u %u 0\n", e, m,
+              e % s->methods == m? 1000000 : (e * 31 + m * 17) % 64);
+  }
+
+  if (fclose(out)) {
+    perror(filename);
+    exit(EX_IOERR);
+  }
+}
+
+/* Runs the generator on the shape, writing the time taken by each phase. */
+static void run(const shape* s, const char* profile, FILE* times) {
+  yaml_parser_t parser;
+  FILE* in = tmpfile(), * devnull = fopen("/dev/null", "w");
+  double start, read, header, impl;
+
+  if (!in || !devnull) {
+    perror("bench_generator");
+    exit(EX_OSERR);
+  }
+  synthesise(in, s, profile);
+  rewind(in);
+
+  input_filename = "gen.yaml";
+  load_defaults();
+
+  start = now();
+  yaml_parser_initialize(&parser);
+  yaml_parser_set_input_file(&parser, in);
+  read_input_file(&parser);
+  yaml_parser_delete(&parser);
+  if (profile_timing) profile_dispatch = 1;
+  if (profile_filename) read_profile(profile_filename);
+  read = now();
+  write_header(devnull);
+  fflush(devnull);
+  header = now();
+  write_impl(devnull);
+  fflush(devnull);
+  impl = now();
+
+  fprintf(times, "%f %f %f\n", read - start, header - read, impl - header);
+}
+
+/* Each run is made in a child process, since the generator keeps the
+ * protocol it read in global state and never frees it.
+ */
+static int measure(const char* series, const shape* s, double* last) {
+  int fds[2], status, ok;
+  pid_t pid;
+  FILE* times;
+  char profile[] = "bench_generator.XXXXXX";
+  double read, header, impl, total;
+
+  if (pipe(fds)) {
+    perror("pipe");
+    return -1;
+  }
+  if (s->options)
+    synthesise_profile(profile, s);
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    if (s->options) remove(profile);
+    return -1;
+  }
+  if (!pid) {
+    close(fds[0]);
+    times = fdopen(fds[1], "w");
+    run(s, s->options? profile : NULL, times);
+    fclose(times);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  times = fdopen(fds[0], "r");
+  ok = 3 == fscanf(times, "%lf %lf %lf", &read, &header, &impl);
+  fclose(times);
+  waitpid(pid, &status, 0);
+  if (s->options) remove(profile);
+  if (!ok) {
+    fprintf(stderr, "%s: generator failed\n", series);
+    return -1;
+  }
+
+  total = read + header + impl;
+  printf("%-9s %6u %6u %6u %6u %10.4f %10.4f %10.4f %10.4f",
+         series, s->elements, s->methods, s->fields, s->depth,
+         read, header, impl, total);
+  if (*last > 0)
+    printf(" %8.2f\n", total / *last);
+  else
+    printf(" %8s\n", "-");
+  *last = total;
+  return 0;
+}
+
+/* Returns the number of doublings given on the command line, or 0 if it is
+ * not a positive number no greater than MAX_STEPS.
+ */
+static unsigned parse_steps(const char* arg) {
+  char* end;
+  unsigned long steps;
+
+  if (!isdigit((unsigned char)*arg)) return 0;
+  steps = strtoul(arg, &end, 10);
+  if (*end || steps > MAX_STEPS) return 0;
+  return steps;
+}
+
+int main(int argc, char** argv) {
+  static const shape base = { 250, 16, 4, 1, 0 };
+  static const char* const series[] = {
+    "elements", "methods", "fields", "depth", "options"
+  };
+  unsigned steps = 6, i, j;
+  shape s;
+  double last;
+
+  if (argc > 2 || (argc == 2 && !(steps = parse_steps(argv[1])))) {
+    fprintf(stderr, "Usage: %s [doublings]\n", argv[0]);
+    return EX_USAGE;
+  }
+
+  printf("%-9s %6s %6s %6s %6s %10s %10s %10s %10s %8s\n",
+         "series", "elts", "meths", "fields", "depth",
+         "read", "header", "impl", "total", "growth");
+  for (i = 0; i < 5; ++i) {
+    s = base;
+    s.options = 4 == i;
+    last = 0;
+    for (j = 0; j < steps; ++j) {
+      if (measure(series[i], &s, &last)) return 1;
+      switch (i) {
+      case 0: s.elements *= 2; break;
+      case 1: s.methods *= 2; break;
+      case 2: s.fields *= 2; break;
+      case 3: s.depth *= 2; break;
+      case 4: s.elements *= 2; break;
+      }
+    }
+  }
+
+  return 0;
+}
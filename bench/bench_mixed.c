@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "mixed.h"
+#include "bench.h"
+
+static const YYLTYPE where;
+static const char* const names[] = { "x", "y", "int", "list" };
+
+void literal_walk(literal_t* this, unsigned long* leaves) {
+  ++*leaves;
+}
+
+/* Builds a balanced tree over n nodes, choosing the widest element which
+ * still fits, and alternating between the two kinds of leaf.
+ */
+static mixed* build_mixed(mixed_CONTEXT_T* context, unsigned long n) {
+  static unsigned long leaves;
+  unsigned long third;
+
+  if (n <= 1)
+    return ++leaves & 1?
+      named_in(context, where, (long)leaves, names[leaves & 3]) :
+      literal_in(context, where, (long)leaves);
+  if (n == 2)
+    return unary_in(context, where, build_mixed(context, 1));
+  if (n == 3)
+    return call_in(context, where, build_mixed(context, 1),
+                   build_mixed(context, 1));
+  third = (n-1) / 3;
+  return typed_call_in(context, where,
+                       build_mixed(context, third),
+                       build_mixed(context, third),
+                       names[n & 3],
+                       build_mixed(context, n-1 - 2*third));
+}
+
+static void* create(void) {
+  return mixed_create_context();
+}
+
+static unsigned long build(void* context, unsigned long nodes, void** root) {
+  *root = build_mixed(context, nodes);
+  return nodes;
+}
+
+static unsigned long traverse(void* root) {
+  unsigned long leaves = 0;
+  walk(root, &leaves);
+  return leaves;
+}
+
+static void dump_tree(void* root, FILE* out) {
+  dump(root, out);
+}
+
+static void destroy(void* context) {
+  mixed_destroy_context(context);
+}
+
+int main(int argc, char** argv) {
+  static const bench_protocol prot = {
+    "mixed", create, build, traverse, dump_tree, destroy
+  };
+  return bench_main(argc, argv, &prot);
+}
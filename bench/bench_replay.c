@@ -0,0 +1,179 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+/*
+  Measures PROTOCOL_replay: a recording of constructor calls is mapped into
+  memory and replayed into a fresh context, and the resulting tree
+  traversed, so that the cost of building a tree can be told apart from that
+  of parsing. Given a file, this replays that recording, which must have
+  been made with the rec protocol; otherwise it records trees of 10^4 up to
+  the given number of nodes itself, as bench_expr builds them. A copy of
+  this program with rec.yaml swapped for one's own protocol can replay
+  recordings of real parses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rec.h"
+
+static const YYLTYPE where;
+
+void num_walk(num_t* this, unsigned long* leaves) {
+  ++*leaves;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static rec* build_rec(rec_CONTEXT_T* context, unsigned long n) {
+  if (n <= 1)
+    return num_in(context, where, (long)n);
+  if (n % 5 == 0 || n == 2)
+    return neg_in(context, where, build_rec(context, n-1));
+  return binop_in(context, where, "+-*/"[n & 3],
+                  build_rec(context, (n-1) / 2),
+                  build_rec(context, n-1 - (n-1) / 2));
+}
+
+/* Records a tree of n nodes into a temporary file, returning its descriptor
+ * or -1 on failure.
+ */
+static int record_tree(unsigned long n) {
+  rec_CONTEXT_T* context = rec_create_context();
+  FILE* out = tmpfile();
+  int fd;
+
+  if (!context || !out) return -1;
+  if (rec_record_to(context, out)) return -1;
+  build_rec(context, n);
+  if (rec_record_to(context, NULL)) return -1;
+  rec_destroy_context(context);
+
+  fd = dup(fileno(out));
+  fclose(out);
+  return fd;
+}
+
+static void print_header(void) {
+  printf("%-24s %12s %12s %12s %12s %12s\n",
+         "recording", "bytes", "replay ms", "replay MB/s", "traverse ms",
+         "leaves");
+}
+
+/* Replays the recording in fd, printing one line of results. */
+static int replay_file(int fd, const char* name) {
+  rec_CONTEXT_T* context;
+  struct stat st;
+  void* map;
+  rec* root;
+  unsigned long leaves = 0;
+  double start, replayed, traversed;
+
+  if (fstat(fd, &st) || !st.st_size) {
+    fprintf(stderr, "%s: empty or unreadable recording\n", name);
+    return 1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == map) {
+    perror(name);
+    return 1;
+  }
+
+  context = rec_create_context();
+  start = now();
+  root = rec_replay(context, map, st.st_size);
+  replayed = now();
+  if (root) walk(root, &leaves);
+  traversed = now();
+  rec_destroy_context(context);
+  munmap(map, st.st_size);
+
+  if (!root) {
+    fprintf(stderr, "%s: not a valid recording for this protocol\n", name);
+    return 1;
+  }
+
+  printf("%-24s %12lu %12.4g %12.4g %12.4g %12lu\n",
+         name, (unsigned long)st.st_size,
+         (replayed - start) * 1e3,
+         st.st_size / (replayed - start) / 1e6,
+         (traversed - replayed) * 1e3,
+         leaves);
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  unsigned long max = 10000000, target;
+  char name[32];
+  int fd, status;
+
+  if (argc == 3 && !strcmp(argv[1], "-f")) {
+    fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+      perror(argv[2]);
+      return 1;
+    }
+    print_header();
+    status = replay_file(fd, argv[2]);
+    close(fd);
+    return status;
+  }
+
+  if (argc > 2 || (argc == 2 && !(max = strtoul(argv[1], NULL, 10)))) {
+    fprintf(stderr, "Usage: %s [max-nodes | -f recording]\n", argv[0]);
+    return 2;
+  }
+
+  print_header();
+  for (target = 10000; target <= max; target *= 10) {
+    fd = record_tree(target);
+    if (fd < 0) {
+      fprintf(stderr, "%s: could not record %lu nodes\n", argv[0], target);
+      return 1;
+    }
+    snprintf(name, sizeof(name), "rec %lu", target);
+    status = replay_file(fd, name);
+    close(fd);
+    if (status) return status;
+  }
+
+  return 0;
+}
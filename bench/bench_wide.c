@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "wide.h"
+#include "bench.h"
+
+static const YYLTYPE where;
+static const char* const names[] = { "a", "b", "tmp", "result" };
+
+void num_walk(num_t* this, unsigned long* leaves) {
+  ++*leaves;
+}
+
+static void* create(void) {
+  return wide_create_context();
+}
+
+/* One block of assignments, each of a number: two nodes per statement. */
+static unsigned long build(void* context, unsigned long nodes, void** root) {
+  wide_seq* stmts = wide_seq_new_in(context);
+  unsigned long i, count = (nodes-1) / 2;
+
+  for (i = 0; i < count; ++i)
+    wide_seq_append_in(context, stmts,
+                       assign_in(context, where, names[i & 3],
+                                 num_in(context, where, (long)i)));
+  *root = block_in(context, where, stmts);
+  return count*2 + 1;
+}
+
+static unsigned long traverse(void* root) {
+  unsigned long leaves = 0;
+  walk(root, &leaves);
+  return leaves;
+}
+
+static void dump_tree(void* root, FILE* out) {
+  dump(root, out);
+}
+
+static void destroy(void* context) {
+  wide_destroy_context(context);
+}
+
+int main(int argc, char** argv) {
+  static const bench_protocol prot = {
+    "wide", create, build, traverse, dump_tree, destroy
+  };
+  return bench_main(argc, argv, &prot);
+}
@@ -37,10 +37,10 @@ SUCH DAMAGE.
 #include <yaml.h>
 
 #include "reader.h"
+#include "profile.h"
 #include "data.h"
 #include "output.h"
 
-static void load_defaults(void);
 static void read_file(FILE*);
 static void do_to_file(void (*)(FILE*), const char*, const char*);
 
@@ -61,6 +61,9 @@ int main(int argc, char** argv) {
   load_defaults();
 
   do_to_file(read_file, input_filename, "r");
+  /* Timing is only collected alongside the call counts */
+  if (profile_timing) profile_dispatch = 1;
+  if (profile_filename) read_profile(profile_filename);
 
   do_to_file(write_header, protocol_header_filename, "w");
   do_to_file(write_impl, protocol_impl_filename, "w");
@@ -68,54 +71,6 @@ int main(int argc, char** argv) {
   return 0;
 }
 
-static void load_defaults(void) {
-  unsigned last_period = strlen(input_filename), i;
-  char* str;
-  method* meth;
-  for (i = last_period; i; --i) {
-    if (input_filename[i] == '.') {
-      last_period = i;
-      break;
-    }
-  }
-
-  protocol_name = str = xmalloc(last_period + 1);
-  memcpy(str, input_filename, last_period);
-  str[last_period] = 0;
-
-  protocol_header_filename = str = xmalloc(last_period + 3);
-  memcpy(str, input_filename, last_period);
-  str[last_period+0] = '.';
-  str[last_period+1] = 'h';
-  str[last_period+2] = 0;
-
-  protocol_impl_filename = str = xmalloc(last_period + 3);
-  memcpy(str, input_filename, last_period);
-  str[last_period+0] = '.';
-  str[last_period+1] = 'c';
-  str[last_period+2] = 0;
-
-  meth = xmalloc(sizeof(method));
-  meth->name = "ctor";
-  meth->return_type = "void";
-  meth->default_impl.type = mit_undefined;
-  meth->default_impl.implemented_by = "";
-  meth->fields = NULL;
-  meth->next = methods;
-  meth->is_implicit = 1;
-  methods = meth;
-
-  meth = xmalloc(sizeof(method));
-  meth->name = "dtor";
-  meth->return_type = "void";
-  meth->default_impl.type = mit_undefined;
-  meth->default_impl.implemented_by = "";
-  meth->fields = NULL;
-  meth->next = methods;
-  meth->is_implicit = 1;
-  methods = meth;
-}
-
 static void read_file(FILE* in) {
   yaml_parser_t parser;
 
@@ -32,6 +32,7 @@ SUCH DAMAGE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "data.h"
 
@@ -42,6 +43,21 @@ const char* protocol_name;
 const char* prologue = "";
 const char* definitions = "";
 const char* epilogue = "";
+int generate_snapshots;
+int thread_local_context;
+int concurrent_context;
+int context_adoption;
+int generate_statistics;
+int profile_dispatch;
+int profile_timing;
+const char* profile_filename;
+unsigned long long profile_total;
+unsigned site_sampling;
+int memory_budget;
+int generate_tracing;
+int generate_recording;
+
+serializer* serializers;
 
 method* methods;
 element* elements;
@@ -65,3 +81,171 @@ char* xstrdup(const char* str) {
 
   return ret;
 }
+
+void load_defaults(void) {
+  unsigned last_period = strlen(input_filename), i;
+  char* str;
+  method* meth;
+  for (i = last_period; i; --i) {
+    if (input_filename[i] == '.') {
+      last_period = i;
+      break;
+    }
+  }
+
+  protocol_name = str = xmalloc(last_period + 1);
+  memcpy(str, input_filename, last_period);
+  str[last_period] = 0;
+
+  protocol_header_filename = str = xmalloc(last_period + 3);
+  memcpy(str, input_filename, last_period);
+  str[last_period+0] = '.';
+  str[last_period+1] = 'h';
+  str[last_period+2] = 0;
+
+  protocol_impl_filename = str = xmalloc(last_period + 3);
+  memcpy(str, input_filename, last_period);
+  str[last_period+0] = '.';
+  str[last_period+1] = 'c';
+  str[last_period+2] = 0;
+
+  meth = xmalloc(sizeof(method));
+  meth->name = "ctor";
+  meth->return_type = "void";
+  meth->default_impl.type = mit_undefined;
+  meth->default_impl.implemented_by = "";
+  meth->fields = NULL;
+  meth->next = methods;
+  meth->is_implicit = 1;
+  meth->calls = 0;
+  meth->dominant = NULL;
+  methods = meth;
+
+  meth = xmalloc(sizeof(method));
+  meth->name = "dtor";
+  meth->return_type = "void";
+  meth->default_impl.type = mit_undefined;
+  meth->default_impl.implemented_by = "";
+  meth->fields = NULL;
+  meth->next = methods;
+  meth->is_implicit = 1;
+  meth->calls = 0;
+  meth->dominant = NULL;
+  methods = meth;
+}
+
+static int skip_whitespace(const char** str) {
+  while (isspace(**str))
+    ++*str;
+
+  return 1;
+}
+
+static int scan_str(const char** str, const char* target) {
+  while (*target)
+    if (**str == *target)
+      ++*str, ++target;
+    else
+      return 0;
+
+  return 1;
+}
+
+int is_protocol_instance(const char* type) {
+  return
+    skip_whitespace(&type) &&
+    scan_str(&type, protocol_name) &&
+    skip_whitespace(&type) &&
+    scan_str(&type, "*") &&
+    skip_whitespace(&type) &&
+    !*type;
+}
+
+int is_protocol_sequence(const char* type) {
+  return
+    skip_whitespace(&type) &&
+    scan_str(&type, protocol_name) &&
+    skip_whitespace(&type) &&
+    scan_str(&type, "*") &&
+    skip_whitespace(&type) &&
+    scan_str(&type, "[") &&
+    skip_whitespace(&type) &&
+    scan_str(&type, "]") &&
+    skip_whitespace(&type) &&
+    !*type;
+}
+
+int is_slice(const char* type) {
+  return
+    skip_whitespace(&type) &&
+    scan_str(&type, protocol_name) &&
+    scan_str(&type, "_slice") &&
+    skip_whitespace(&type) &&
+    !*type;
+}
+
+int is_void(const char* type) {
+  return
+    skip_whitespace(&type) &&
+    scan_str(&type, "void") &&
+    skip_whitespace(&type) &&
+    !*type;
+}
+
+int is_string(const char* type) {
+  const char* after_const;
+
+  /* Optional leading const */
+  skip_whitespace(&type);
+  after_const = type;
+  if (scan_str(&after_const, "const"))
+    type = after_const;
+  skip_whitespace(&type);
+
+  return
+    scan_str(&type, "char") &&
+    skip_whitespace(&type) &&
+    scan_str(&type, "*") &&
+    skip_whitespace(&type) &&
+    !*type;
+}
+
+/*
+  Returns whether the given type is a pointer whose target astrocol knows
+  nothing about, and so cannot be copied into a snapshot by value. Pointers
+  are only recognised by their '*', so any type with a serializer also counts,
+  which is how typedefs of pointer types are declared.
+ */
+int is_opaque(const char* type) {
+  if (find_serializer(type)) return 1;
+
+  return
+    strchr(type, '*') &&
+    !is_protocol_instance(type) &&
+    !is_protocol_sequence(type) &&
+    !is_string(type);
+}
+
+static int types_equal(const char* a, const char* b) {
+  for (;;) {
+    skip_whitespace(&a);
+    skip_whitespace(&b);
+    if (*a != *b) return 0;
+    if (!*a) return 1;
+    ++a, ++b;
+  }
+}
+
+/*
+  Returns the prefix of the custom serializer for the given type, or NULL if
+  there is none.
+ */
+const char* find_serializer(const char* type) {
+  serializer* ser;
+
+  for (ser = serializers; ser; ser = ser->next)
+    if (types_equal(type, ser->type))
+      return ser->prefix;
+
+  return NULL;
+}
@@ -37,6 +37,28 @@ extern const char* protocol_name;
 extern const char* prologue;
 extern const char* definitions;
 extern const char* epilogue;
+extern int generate_snapshots;
+extern int thread_local_context;
+extern int concurrent_context;
+extern int context_adoption;
+extern int generate_statistics;
+extern int profile_dispatch;
+extern int profile_timing;
+extern const char* profile_filename;
+/* Calls to all methods from the dispatch profile, if there is one */
+extern unsigned long long profile_total;
+extern unsigned site_sampling;
+extern int memory_budget;
+extern int generate_tracing;
+extern int generate_recording;
+
+typedef struct serializer_s {
+  const char* type;
+  const char* prefix;
+  struct serializer_s* next;
+} serializer;
+
+extern serializer* serializers;
 
 typedef struct field_s {
   const char* type;
@@ -53,7 +75,10 @@ typedef enum {
   mit_does_nothing,
   mit_undefined,
   mit_custom,
-  mit_graphviz
+  mit_graphviz,
+  mit_structural_hash,
+  mit_cached_structural_hash,
+  mit_structural_equals
 } method_impl_type;
 
 typedef struct {
@@ -68,6 +93,10 @@ typedef struct method_s {
   field* fields;
   struct method_s* next;
   int is_implicit;
+  /* Calls from the dispatch profile, if there is one, and the element
+   * receiving most of them, if any */
+  unsigned long long calls;
+  struct element_s* dominant;
 } method;
 
 extern method* methods;
@@ -88,7 +117,15 @@ typedef struct element_s {
   const char* name;
   field* members;
   method_impl* implementations;
+  /* Calls to each method from the dispatch profile, if there is one */
+  unsigned long long* calls;
+  /* Calls to each method which reach this element's own implementation,
+   * including those to elements inheriting it */
+  unsigned long long* impl_calls;
   struct element_s* next;
+  int is_interned;
+  /* Position in the elements list, assigned once the input has been read */
+  unsigned index;
 } element;
 
 extern element* elements;
@@ -96,4 +133,19 @@ extern element* elements;
 void* xmalloc(size_t);
 char* xstrdup(const char*);
 
+/* Derives the protocol name and output filenames from input_filename, and
+ * adds the implicit ctor and dtor methods.
+ */
+void load_defaults(void);
+
+/* Field type classification; these depend on protocol_name being set. */
+int is_protocol_instance(const char*);
+int is_protocol_sequence(const char*);
+int is_slice(const char*);
+int is_void(const char*);
+int is_string(const char*);
+int is_opaque(const char*);
+
+const char* find_serializer(const char*);
+
 #endif /* DATA_H_ */
@@ -57,6 +57,66 @@ static void xprintf(FILE* out, const char* format, ...) {
   va_end(args);
 }
 
+static int uses_slices(void);
+static int uses_strings(void);
+
+static unsigned method_index(method* target) {
+  method* meth;
+  unsigned ix = 0;
+
+  for (meth = methods; meth != target; meth = meth->next)
+    ++ix;
+
+  return ix;
+}
+
+static unsigned element_index(element* target) {
+  return target->index;
+}
+
+static unsigned count_elements(void) {
+  element* elt;
+  unsigned cnt = 0;
+
+  for (elt = elements; elt; elt = elt->next)
+    ++cnt;
+
+  return cnt;
+}
+
+/*
+  With a dispatch profile, an implementation is hot if it received at least
+  1% of all calls, and cold if it received none. Its calls include those to
+  every element which inherits it from the target.
+ */
+static int method_heat(element* target, unsigned ix) {
+  if (!target->impl_calls || !profile_total) return 0;
+  if (!target->impl_calls[ix]) return -1;
+  return target->impl_calls[ix] * 100 >= profile_total;
+}
+
+static int uses_interning(void) {
+  element* elt;
+
+  for (elt = elements; elt; elt = elt->next)
+    if (elt->is_interned)
+      return 1;
+
+  return 0;
+}
+
+static int uses_impl_type(method_impl_type type) {
+  element* elt;
+  unsigned ix, num_methods = count_methods();
+
+  for (elt = elements; elt; elt = elt->next)
+    for (ix = 0; ix < num_methods; ++ix)
+      if (type == elt->implementations[ix].type)
+        return 1;
+
+  return 0;
+}
+
 static inline void on_each_elt(FILE* out, void (*f)(FILE*, element*)) {
   element* elt;
   for (elt = elements; elt; elt = elt->next)
@@ -65,6 +125,9 @@ static inline void on_each_elt(FILE* out, void (*f)(FILE*, element*)) {
 
 static void declare_globals(FILE*);
 static void declare_predefinitions(FILE*);
+static void declare_dispatch_profile(FILE*);
+static void declare_trace_macros(FILE*);
+static void write_thread_local_macro(FILE*);
 static void declare_protocol_struct(FILE*);
 static void declare_protocol_vtable(FILE*);
 static void declare_protocol_methods(FILE*);
@@ -74,6 +137,9 @@ static void declare_protocol_custom_defaults(FILE*);
 static void declare_method_impls(FILE*);
 static void declare_memman_funs(FILE*);
 static void define_element_types(FILE*);
+static void declare_snapshot_funs(FILE*);
+static void declare_serializers(FILE*);
+static void define_recording_funs(FILE*);
 void write_header(FILE* output) {
   xprintf(output,
           "/*\n"
@@ -95,20 +161,141 @@ void write_header(FILE* output) {
   declare_protocol_custom_defaults(output);
   declare_method_impls(output);
   declare_memman_funs(output);
+  if (generate_snapshots)
+    declare_snapshot_funs(output);
+  if (generate_snapshots || generate_recording)
+    declare_serializers(output);
+  if (generate_recording)
+    xprintf(output,
+            "int %s_record_to(%s_CONTEXT_T*, FILE*);\n"
+            "%s* %s_replay(%s_CONTEXT_T*, const void*, size_t);\n",
+            protocol_name, protocol_name,
+            protocol_name, protocol_name, protocol_name);
+  if (generate_statistics)
+    xprintf(output,
+            "size_t %s_get_stats(%s_CONTEXT_T*, %s_stats_t*);\n"
+            "void %s_dump_stats(%s_CONTEXT_T*, FILE*);\n",
+            protocol_name, protocol_name, protocol_name,
+            protocol_name, protocol_name);
+  if (profile_dispatch)
+    declare_dispatch_profile(output);
+  if (site_sampling)
+    xprintf(output,
+            "void %s_write_site_report(%s_CONTEXT_T*, FILE*, unsigned);\n",
+            protocol_name, protocol_name);
+  if (memory_budget)
+    xprintf(output,
+            "void %s_set_budget(%s_CONTEXT_T*, size_t);\n"
+            "size_t %s_budget_used(%s_CONTEXT_T*);\n",
+            protocol_name, protocol_name, protocol_name, protocol_name);
+  declare_trace_macros(output);
   define_element_types(output);
 
   xprintf(output, "#endif\n");
 }
 
 static void declare_predefinitions(FILE* out) {
+  if (generate_snapshots || generate_statistics || profile_dispatch ||
+      site_sampling || generate_recording)
+    xprintf(out, "#include <stdio.h>\n");
+  if (profile_filename)
+    xprintf(out,
+            "#ifndef ASTROCOL_HOT\n"
+            "#ifdef __GNUC__\n"
+            "#define ASTROCOL_HOT __attribute__((hot))\n"
+            "#define ASTROCOL_COLD __attribute__((cold))\n"
+            "#else\n"
+            "#define ASTROCOL_HOT\n"
+            "#define ASTROCOL_COLD\n"
+            "#endif\n"
+            "#endif\n");
   xprintf(out, "typedef struct %s_s %s;\n",
           protocol_name, protocol_name);
   xprintf(out,
           "typedef struct {\n"
-          "  %s* last;\n"
-          "  void (*oom)(void);\n"
-          "} %s_context_t;\n",
+          "  unsigned count, capacity;\n"
+          "  %s** items;\n"
+          "} %s_seq;\n",
           protocol_name, protocol_name);
+  xprintf(out,
+          "typedef struct {\n"
+          "  const char* str;\n"
+          "  size_t len;\n"
+          "} %s_slice;\n",
+          protocol_name);
+  xprintf(out,
+          "typedef struct {\n"
+          "  size_t hash;\n"
+          "  void* value;\n"
+          "} %s_hash_slot;\n"
+          "typedef struct {\n"
+          "  size_t count, mask;\n"
+          "  %s_hash_slot* slots;\n"
+          "} %s_hash_table;\n",
+          protocol_name, protocol_name, protocol_name);
+  if (generate_statistics)
+    xprintf(out,
+            "typedef struct {\n"
+            "  const char* name;\n"
+            "  size_t live, total, bytes;\n"
+            "} %s_stats_t;\n"
+            "#define %s_STATS_COUNT %u\n",
+            protocol_name, protocol_name, count_elements() + 1);
+  if (site_sampling)
+    xprintf(out,
+            "typedef struct {\n"
+            "  long first_line;\n"
+            "  unsigned element;\n"
+            "  size_t samples, bytes;\n"
+            "} %s_site_t;\n",
+            protocol_name);
+  xprintf(out,
+          "typedef struct %s_context_s {\n"
+          "  %s* last, * first;\n"
+          "  unsigned long generation;\n"
+          "  struct %s_context_s* merged;\n"
+          "  void (*oom)(void);\n"
+          "  %s_hash_table strings;\n"
+          "  char* string_arena;\n"
+          "  size_t string_arena_left;\n"
+          "  char* region;\n"
+          "  size_t region_size, region_used;\n"
+          "  int region_mapped;\n",
+          protocol_name, protocol_name, protocol_name, protocol_name);
+  if (uses_interning())
+    xprintf(out, "  %s_hash_table interned;\n", protocol_name);
+  if (context_adoption)
+    xprintf(out,
+            "  %s** adopted;\n"
+            "  size_t adopted_count, adopted_size;\n"
+            "  unsigned refs;\n",
+            protocol_name);
+  if (concurrent_context)
+    xprintf(out,
+            "  int strings_lock;\n"
+            "  int interned_lock;\n");
+  if (concurrent_context && context_adoption)
+    xprintf(out, "  int adopted_lock;\n");
+  if (generate_statistics)
+    xprintf(out, "  %s_stats_t stats[%s_STATS_COUNT];\n",
+            protocol_name, protocol_name);
+  if (site_sampling)
+    xprintf(out,
+            "  %s_site_t* sites;\n"
+            "  size_t site_count, site_mask;\n"
+            "  unsigned site_counter;\n",
+            protocol_name);
+  if (site_sampling && concurrent_context)
+    xprintf(out, "  int sites_lock;\n");
+  if (memory_budget)
+    xprintf(out, "  size_t budget, budget_used;\n");
+  if (generate_tracing)
+    xprintf(out, "  int traced_node;\n");
+  if (generate_recording)
+    xprintf(out, "  struct astrocol_recorder_s* recorder;\n");
+  if (generate_recording && concurrent_context)
+    xprintf(out, "  int recorder_lock;\n");
+  xprintf(out, "} %s_context_t;\n", protocol_name);
 }
 
 static void declare_globals(FILE* out) {
@@ -117,14 +304,29 @@ static void declare_globals(FILE* out) {
           "#define %s_CONTEXT_T %s_context_t\n"
           "#endif\n",
           protocol_name, protocol_name, protocol_name);
+  if (thread_local_context)
+    write_thread_local_macro(out);
   xprintf(out,
-          "extern %s_CONTEXT_T* %s_context;\n",
+          "extern %s%s_CONTEXT_T* %s_context;\n",
+          thread_local_context? "ASTROCOL_THREAD_LOCAL " : "",
           protocol_name, protocol_name);
   xprintf(out,
           "%s_CONTEXT_T* %s_create_context(void);\n"
-          "void %s_destroy_context(%s_CONTEXT_T*);\n",
+          "#define %s_CONTEXT_HUGE_PAGES 1u\n"
+          "#define %s_CONTEXT_PREFAULT 2u\n"
+          "%s_CONTEXT_T* %s_create_context_sized(size_t, unsigned);\n"
+          "void %s_destroy_context(%s_CONTEXT_T*);\n"
+          "void %s_merge_context(%s_CONTEXT_T*, %s_CONTEXT_T*);\n",
           protocol_name, protocol_name,
-          protocol_name, protocol_name);
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name);
+  if (context_adoption)
+    xprintf(out,
+            "%s* %s_adopt(%s_CONTEXT_T*, %s_CONTEXT_T*, %s*);\n",
+            protocol_name, protocol_name, protocol_name, protocol_name,
+            protocol_name);
 }
 
 static void declare_protocol_struct(FILE* out) {
@@ -165,7 +367,11 @@ static void write_args(FILE* out, field* arg, char implicit) {
 
   /* Recursive case: Write earlier arguments, then this one */
   write_args(out, arg->next, implicit);
-  xprintf(out, ", %s %s", arg->type, arg->name);
+  /* Sequences are passed in as the builder, rather than by value */
+  if (is_protocol_sequence(arg->type))
+    xprintf(out, ", %s_seq* %s", protocol_name, arg->name);
+  else
+    xprintf(out, ", %s %s", arg->type, arg->name);
 }
 
 static void declare_protocol_vtable(FILE* out) {
@@ -181,6 +387,14 @@ static void declare_protocol_vtable(FILE* out) {
     xprintf(out, ");\n");
   }
 
+  xprintf(out,
+          "  /** The index of the element; used internally. */\n"
+          "  unsigned element;\n");
+  if (uses_interning())
+    xprintf(out,
+            "  /** Whether instances are shared; used internally. */\n"
+            "  int interned;\n");
+
   xprintf(out, "} %s_vtable;\n", protocol_name);
 }
 
@@ -203,23 +417,123 @@ static void declare_element_ctors(FILE* out) {
 
     write_args(out, elt->members, '_');
     xprintf(out, ");\n");
+
+    xprintf(out, "%s* %s_in(%s_CONTEXT_T*, YYLTYPE",
+            protocol_name, elt->name, protocol_name);
+    write_args(out, elt->members, '_');
+    xprintf(out, ");\n");
   }
 }
 
 static void declare_memman_funs(FILE* out) {
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s* last;\n"
+          "  unsigned long generation;\n"
+          "} %s_mark_t;\n"
+          "%s_mark_t %s_mark(void);\n"
+          "int %s_release_to(%s_mark_t);\n"
+          "void %s_collect(%s_CONTEXT_T*, %s**, size_t);\n"
+          "void %s_destroy_subtree(%s*);\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name);
   xprintf(out,
           "void* %s_dalloc(size_t, void (*)(void*));\n"
           "void* %s_malloc(size_t);\n"
-          "char* %s_strdup(const char*);\n",
-          protocol_name, protocol_name, protocol_name);
+          "char* %s_strdup(const char*);\n"
+          "const char* %s_intern(const char*, size_t);\n"
+          "void %s_retain(void*, void (*)(void*));\n"
+          "%s_seq* %s_seq_new(void);\n"
+          "%s_seq* %s_seq_append(%s_seq*, %s*);\n"
+          "void* %s_dalloc_in(%s_CONTEXT_T*, size_t, void (*)(void*));\n"
+          "void* %s_malloc_in(%s_CONTEXT_T*, size_t);\n"
+          "char* %s_strdup_in(%s_CONTEXT_T*, const char*);\n"
+          "const char* %s_intern_in(%s_CONTEXT_T*, const char*, size_t);\n"
+          "void %s_retain_in(%s_CONTEXT_T*, void*, void (*)(void*));\n"
+          "%s_seq* %s_seq_new_in(%s_CONTEXT_T*);\n"
+          "%s_seq* %s_seq_append_in(%s_CONTEXT_T*, %s_seq*, %s*);\n"
+          "%s* %s_clone_into(%s_CONTEXT_T*, %s*);\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name);
+}
+
+/*
+  The tracing macros are always defined, so that code using them need not
+  change when tracing is turned off; they then expand to nothing.
+ */
+static void declare_trace_macros(FILE* out) {
+  if (generate_tracing)
+    xprintf(out,
+            "void %s_trace_event(const char*, char);\n"
+            "int %s_write_trace(FILE*);\n"
+            "void %s_reset_trace(void);\n"
+            "#define %s_TRACE_BEGIN(name) %s_trace_event((name), 'B')\n"
+            "#define %s_TRACE_END(name) %s_trace_event((name), 'E')\n"
+            "#define %s_TRACE_MARK(name) %s_trace_event((name), 'i')\n",
+            protocol_name, protocol_name, protocol_name,
+            protocol_name, protocol_name,
+            protocol_name, protocol_name,
+            protocol_name, protocol_name);
+  else
+    xprintf(out,
+            "#define %s_TRACE_BEGIN(name) ((void)0)\n"
+            "#define %s_TRACE_END(name) ((void)0)\n"
+            "#define %s_TRACE_MARK(name) ((void)0)\n",
+            protocol_name, protocol_name, protocol_name);
+}
+
+static void declare_dispatch_profile(FILE* out) {
+  unsigned nmethods = count_methods();
+
+  xprintf(out,
+          "typedef struct {\n"
+          "  unsigned long long calls, ticks;\n"
+          "} %s_dispatch_count_t;\n"
+          "#define %s_DISPATCH_ELEMENTS %u\n"
+          "#define %s_DISPATCH_METHODS %u\n"
+          "extern %s_dispatch_count_t %s_dispatch_profile[%u][%u];\n"
+          "void %s_write_dispatch_profile(FILE*);\n"
+          "void %s_reset_dispatch_profile(void);\n",
+          protocol_name,
+          protocol_name, count_elements(),
+          protocol_name, nmethods,
+          protocol_name, protocol_name, count_elements(), nmethods,
+          protocol_name,
+          protocol_name);
 }
 
+static void define_region_funs(FILE*);
+static void define_trace_funs(FILE*);
+static void define_budget_funs(FILE*);
+static void define_chain_funs(FILE*);
+static void define_element_names(FILE*);
+static void define_statistics_funs(FILE*);
+static void define_dispatch_profile(FILE*);
+static void define_site_funs(FILE*);
+static void define_hash_funs(FILE*);
+static void define_hash_table_funs(FILE*);
 static void define_protocol_vcalls(FILE*);
 static void define_element_vtables(FILE*);
 static void define_implementations(FILE*);
 static void define_element_ctors(FILE*);
 static void define_protocol_context(FILE*);
 static void define_memman_funs(FILE*);
+static void define_node_funs(FILE*);
+static void define_clone_funs(FILE*);
+static void define_release_funs(FILE*);
+static void define_adoption_funs(FILE*);
+static void define_snapshot_funs(FILE*);
 void write_impl(FILE* out) {
   xprintf(out,
           "/*\n"
@@ -240,116 +554,945 @@ void write_impl(FILE* out) {
           protocol_header_filename,
           prologue,
           protocol_name, protocol_name, protocol_name);
+  if (generate_snapshots)
+    xprintf(out,
+            "#include <sys/types.h>\n"
+            "#include <sys/stat.h>\n"
+            "#include <sys/mman.h>\n"
+            "#include <fcntl.h>\n"
+            "#include <unistd.h>\n");
+  else
+    xprintf(out,
+            "#if defined(__unix__) || defined(__APPLE__)\n"
+            "#include <sys/mman.h>\n"
+            "#endif\n");
+  if (memory_budget)
+    define_budget_funs(out);
   xprintf(out,
-          "static void* astrocol_malloc(size_t sz) {\n"
-          "  void* ret = malloc(sz);\n"
+          "static void* astrocol_malloc(%s_context_t* context, size_t sz) {\n"
+          "  void* ret;\n"
+          "%s"
+          "  ret = malloc(sz);\n"
           "  if (ret) return ret;\n"
-          "  (*%s_CONTEXT->oom)();\n"
+          "  (*context->oom)();\n"
           "  abort();\n"
-          "}\n",
+          "}\n"
+          "static void astrocol_seq_clear(%s_seq*);\n",
+          protocol_name,
+          memory_budget? "  astrocol_charge(context, sz);\n" : "",
           protocol_name);
+  xprintf(out,
+          "typedef union {\n"
+          "  long l;\n"
+          "  double d;\n"
+          "  void* p;\n"
+          "} astrocol_align;\n"
+          "#define ASTROCOL_ROUND(sz) \\\n"
+          "  (((sz) + sizeof(astrocol_align) - 1) / sizeof(astrocol_align) * \\\n"
+          "   sizeof(astrocol_align))\n");
+  /* Elements constructed by a ctor method are made again when the outer
+   * call is replayed, so only calls at depth zero are recorded.
+   */
+  if (generate_recording) {
+    if (!thread_local_context)
+      write_thread_local_macro(out);
+    xprintf(out,
+            "static void astrocol_record(%s_context_t*, %s*);\n"
+            "static void astrocol_record_stop(%s_context_t*);\n"
+            "static ASTROCOL_THREAD_LOCAL unsigned astrocol_record_depth;\n",
+            protocol_name, protocol_name, protocol_name);
+  }
+  define_region_funs(out);
+  define_chain_funs(out);
+  if (generate_statistics || profile_dispatch || site_sampling)
+    define_element_names(out);
+  if (generate_statistics)
+    define_statistics_funs(out);
+  if (site_sampling)
+    define_site_funs(out);
+  if (profile_dispatch)
+    define_dispatch_profile(out);
+  if (generate_tracing)
+    define_trace_funs(out);
+  define_hash_funs(out);
+  define_hash_table_funs(out);
+  if ((uses_impl_type(mit_structural_equals) || uses_interning()) &&
+      uses_strings())
+    xprintf(out,
+            "static int astrocol_string_equals(const char* a, const char* b) {\n"
+            "  return a == b || (a && b && !strcmp(a, b));\n"
+            "}\n");
+  if ((uses_impl_type(mit_structural_equals) || uses_interning()) &&
+      uses_slices())
+    xprintf(out,
+            "static int astrocol_slice_equals(%s_slice a, %s_slice b) {\n"
+            "  return a.len == b.len &&\n"
+            "    (a.str == b.str || !memcmp(a.str, b.str, a.len));\n"
+            "}\n",
+            protocol_name, protocol_name);
   define_protocol_vcalls(out);
   define_element_vtables(out);
   define_implementations(out);
   define_element_ctors(out);
   define_protocol_context(out);
   define_memman_funs(out);
+  define_node_funs(out);
+  define_clone_funs(out);
+  define_release_funs(out);
+  if (generate_snapshots)
+    define_snapshot_funs(out);
+  if (generate_recording)
+    define_recording_funs(out);
   fputs(epilogue, out);
 }
 
-static const char* get_implementor_name(method* meth,
-                                        unsigned ix,
-                                        element* elt) {
-  /* If not "implemented by" the protocol, that field is always correct. */
-  if (strcmp(protocol_name, elt->implementations[ix].implemented_by))
-    return elt->implementations[ix].implemented_by;
+static void write_thread_local_macro(FILE* out) {
+  xprintf(out,
+          "#ifndef ASTROCOL_THREAD_LOCAL\n"
+          "#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L\n"
+          "#define ASTROCOL_THREAD_LOCAL _Thread_local\n"
+          "#else\n"
+          "#define ASTROCOL_THREAD_LOCAL __thread\n"
+          "#endif\n"
+          "#endif\n");
+}
 
-  /* Each element actually implements methods provided by the protocol, unless
-   * the protocol provides a custom default.
+/*
+  Each thread records events into its own ring of ASTROCOL_TRACE_EVENTS
+  entries, so recording needs no synchronisation; the rings are linked
+  together when created so that they can all be written out, and are never
+  freed. Names are kept by pointer, so must outlive the trace.
+ */
+static void define_trace_funs(FILE* out) {
+  if (!thread_local_context)
+    write_thread_local_macro(out);
+  xprintf(out,
+          "#include <time.h>\n"
+          "#ifndef ASTROCOL_TRACE_EVENTS\n"
+          "#define ASTROCOL_TRACE_EVENTS 4096\n"
+          "#endif\n"
+          "typedef struct {\n"
+          "  const char* name;\n"
+          "  const void* context;\n"
+          "  unsigned long long ns;\n"
+          "  char phase;\n"
+          "} astrocol_trace_event;\n"
+          "typedef struct astrocol_trace_ring_s {\n"
+          "  struct astrocol_trace_ring_s* next;\n"
+          "  unsigned tid;\n"
+          "  unsigned long count;\n"
+          "  astrocol_trace_event events[ASTROCOL_TRACE_EVENTS];\n"
+          "} astrocol_trace_ring;\n"
+          "static astrocol_trace_ring* astrocol_trace_rings;\n"
+          "static unsigned astrocol_trace_threads;\n"
+          "static ASTROCOL_THREAD_LOCAL astrocol_trace_ring*"
+          " astrocol_trace_local;\n"
+          "static unsigned long long astrocol_trace_now(void) {\n"
+          "#ifdef CLOCK_MONOTONIC\n"
+          "  struct timespec ts;\n"
+          "  clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+          "  return ts.tv_sec * 1000000000ull + ts.tv_nsec;\n"
+          "#else\n"
+          "  return (unsigned long long)clock() *"
+          " (1000000000ull / CLOCKS_PER_SEC);\n"
+          "#endif\n"
+          "}\n"
+          "static astrocol_trace_ring* astrocol_trace_ring_new(void) {\n"
+          "  astrocol_trace_ring* ring = malloc(sizeof(astrocol_trace_ring));\n"
+          "  if (!ring) return NULL;\n"
+          "  ring->count = 0;\n"
+          "#ifdef __GNUC__\n"
+          "  ring->tid = __atomic_add_fetch(&astrocol_trace_threads, 1,"
+          " __ATOMIC_RELAXED);\n"
+          "  ring->next = __atomic_load_n(&astrocol_trace_rings,"
+          " __ATOMIC_RELAXED);\n"
+          "  while (!__atomic_compare_exchange_n(&astrocol_trace_rings,"
+          " &ring->next, ring,\n"
+          "                                      1, __ATOMIC_RELEASE,"
+          " __ATOMIC_RELAXED));\n"
+          "#else\n"
+          "  ring->tid = ++astrocol_trace_threads;\n"
+          "  ring->next = astrocol_trace_rings;\n"
+          "  astrocol_trace_rings = ring;\n"
+          "#endif\n"
+          "  return astrocol_trace_local = ring;\n"
+          "}\n"
+          "static void astrocol_trace(const char* name, char phase,"
+          " const void* context) {\n"
+          "  astrocol_trace_ring* ring = astrocol_trace_local;\n"
+          "  astrocol_trace_event* evt;\n"
+          "  /* Tracing is best-effort, so a failure to allocate is ignored */\n"
+          "  if (!ring && !(ring = astrocol_trace_ring_new())) return;\n"
+          "  evt = ring->events + ring->count++ %% ASTROCOL_TRACE_EVENTS;\n"
+          "  evt->name = name;\n"
+          "  evt->context = context;\n"
+          "  evt->phase = phase;\n"
+          "  evt->ns = astrocol_trace_now();\n"
+          "}\n"
+          "void %s_trace_event(const char* name, char phase) {\n"
+          "  astrocol_trace(name, phase, %s_context);\n"
+          "}\n"
+          "void %s_reset_trace(void) {\n"
+          "  astrocol_trace_ring* ring;\n"
+          "  for (ring = astrocol_trace_rings; ring; ring = ring->next)\n"
+          "    ring->count = 0;\n"
+          "}\n",
+          protocol_name, protocol_name,
+          protocol_name);
+
+  /* Chrome's trace event format: timestamps are in microseconds, and
+   * instant events are scoped to their thread.
    */
-  if (mit_custom == elt->implementations[ix].type)
-    return protocol_name;
-  else
-    return elt->name;
+  xprintf(out,
+          "static void astrocol_trace_string(FILE* out, const char* s) {\n"
+          "  putc('\"', out);\n"
+          "  for (; *s; ++s) {\n"
+          "    if (*s == '\"' || *s == '\\\\')\n"
+          "      fprintf(out, \"\\\\%%c\", *s);\n"
+          "    else if ((unsigned char)*s < 0x20)\n"
+          "      fprintf(out, \"\\\\u%%04x\", (unsigned)*s);\n"
+          "    else\n"
+          "      putc(*s, out);\n"
+          "  }\n"
+          "  putc('\"', out);\n"
+          "}\n"
+          "int %s_write_trace(FILE* out) {\n"
+          "  const astrocol_trace_ring* ring;\n"
+          "  const astrocol_trace_event* evt;\n"
+          "  unsigned long i;\n"
+          "  const char* sep = \"\\n\";\n"
+          "  fputs(\"{\\\"traceEvents\\\":[\", out);\n"
+          "  for (ring = astrocol_trace_rings; ring; ring = ring->next) {\n"
+          "    i = ring->count > ASTROCOL_TRACE_EVENTS?\n"
+          "      ring->count - ASTROCOL_TRACE_EVENTS : 0;\n"
+          "    for (; i < ring->count; ++i) {\n"
+          "      evt = ring->events + i %% ASTROCOL_TRACE_EVENTS;\n"
+          "      fprintf(out, \"%%s{\\\"name\\\":\", sep);\n"
+          "      astrocol_trace_string(out, evt->name);\n"
+          "      fprintf(out, \",\\\"ph\\\":\\\"%%c\\\","
+          "\\\"ts\\\":%%llu.%%03u,\\\"pid\\\":1,\"\n"
+          "              \"\\\"tid\\\":%%u%%s,\\\"args\\\":"
+          "{\\\"context\\\":\\\"%%p\\\"}}\",\n"
+          "              evt->phase, evt->ns / 1000,"
+          " (unsigned)(evt->ns %% 1000),\n"
+          "              ring->tid,"
+          " evt->phase == 'i'? \",\\\"s\\\":\\\"t\\\"\" : \"\",\n"
+          "              (void*)evt->context);\n"
+          "      sep = \",\\n\";\n"
+          "    }\n"
+          "  }\n"
+          "  fputs(\"\\n]}\\n\", out);\n"
+          "  return ferror(out)? -1 : 0;\n"
+          "}\n",
+          protocol_name);
 }
 
-static void declare_element_method_impls(FILE* out, element* elt) {
-  method* meth;
-  unsigned i = 0;
-
-  for (meth = methods; meth; meth = meth->next, ++i) {
-    /* Only need to declare something if a version specific to this element
-     * must be generated.
-     */
-    if (mit_undefined != elt->implementations[i].type &&
-        !strcmp(elt->name, get_implementor_name(meth, i, elt))) {
-      xprintf(out,
-              "extern %s %s_%s(%s_t*",
-              meth->return_type,
-              elt->name,
-              meth->name,
-              elt->name);
-      write_args(out, meth->fields, 0);
-      xprintf(out, ");\n");
-    }
-  }
+/*
+  The budget is checked against a running total of the bytes allocated in a
+  context, which is never reduced when they are freed, so the check is only
+  an addition and a comparison.
+ */
+static void define_budget_funs(FILE* out) {
+  xprintf(out,
+          "static int astrocol_try_charge(%s_context_t* context, size_t sz) {\n",
+          protocol_name);
+  if (concurrent_context)
+    xprintf(out,
+            "  if (__atomic_add_fetch(&context->budget_used, sz,"
+            " __ATOMIC_RELAXED) >\n"
+            "      context->budget) {\n"
+            "    __atomic_sub_fetch(&context->budget_used, sz,"
+            " __ATOMIC_RELAXED);\n"
+            "    return 1;\n"
+            "  }\n");
+  else
+    xprintf(out,
+            "  if (context->budget_used > context->budget ||\n"
+            "      sz > context->budget - context->budget_used)\n"
+            "    return 1;\n"
+            "  context->budget_used += sz;\n");
+  xprintf(out,
+          "  return 0;\n"
+          "}\n"
+          "static void astrocol_charge(%s_context_t* context, size_t sz) {\n"
+          "  if (astrocol_try_charge(context, sz)) {\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "}\n"
+          "void %s_set_budget(%s_CONTEXT_T* context, size_t bytes) {\n"
+          "  ((%s_context_t*)context)->budget = bytes;\n"
+          "}\n"
+          "size_t %s_budget_used(%s_CONTEXT_T* context) {\n"
+          "  return ((%s_context_t*)context)->budget_used;\n"
+          "}\n",
+          protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name);
 }
 
-static void declare_protocol_custom_defaults(FILE* out) {
-  method* meth;
+/*
+  Contexts created with a size hint carve elements and dalloc memory out of a
+  single region, reserved up front. Items in the region are given a
+  destructor which does not free them; the region goes away with the context.
+ */
+static void define_region_funs(FILE* out) {
+  xprintf(out,
+          "#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)\n"
+          "#define MAP_ANONYMOUS MAP_ANON\n"
+          "#endif\n"
+          "#if defined(MAP_ANONYMOUS) && !defined(ASTROCOL_NO_MMAP)\n"
+          "#define ASTROCOL_HAVE_MMAP 1\n"
+          "#endif\n"
+          "static void astrocol_region_item_dtor(void*);\n"
+          "static void* astrocol_alloc_item(%s_context_t* context, size_t sz,\n"
+          "                                 void (**dtor)(void*)) {\n"
+          "  size_t off;\n"
+          "  if (context->region_size) {\n",
+          protocol_name);
+  /* Space is only claimed while it fits, so once the region is full the
+   * threads merely read the shared counter before falling back to malloc.
+   */
+  if (concurrent_context)
+    xprintf(out,
+            "    off = __atomic_load_n(&context->region_used,"
+            " __ATOMIC_RELAXED);\n"
+            "    while (context->region_size - off >= ASTROCOL_ROUND(sz)) {\n"
+            "      if (!__atomic_compare_exchange_n(\n"
+            "            &context->region_used, &off, off + ASTROCOL_ROUND(sz),"
+            " 1,\n"
+            "            __ATOMIC_RELAXED, __ATOMIC_RELAXED))\n"
+            "        continue;\n");
+  else
+    xprintf(out,
+            "    off = context->region_used;\n"
+            "    if (context->region_size - off >= ASTROCOL_ROUND(sz)) {\n"
+            "      context->region_used += ASTROCOL_ROUND(sz);\n");
+  if (memory_budget)
+    xprintf(out, "      astrocol_charge(context, sz);\n");
+  xprintf(out,
+          "      *dtor = astrocol_region_item_dtor;\n"
+          "      return context->region + off;\n"
+          "    }\n"
+          "  }\n"
+          "  return astrocol_malloc(context, sz);\n"
+          "}\n"
+          "static void astrocol_free_context(%s_context_t* context) {\n"
+          "#ifdef ASTROCOL_HAVE_MMAP\n"
+          "  if (context->region_mapped)\n"
+          "    munmap(context->region, context->region_size);\n"
+          "  else\n"
+          "#endif\n"
+          "    free(context->region);\n"
+          "%s"
+          "%s"
+          "  free(context);\n"
+          "}\n",
+          protocol_name,
+          site_sampling? "  free(context->sites);\n" : "",
+          generate_recording? "  astrocol_record_stop(context);\n" : "");
+}
 
-  for (meth = methods; meth; meth = meth->next) {
-    if (mit_custom == meth->default_impl.type) {
-      xprintf(out,
-              "extern %s %s_%s(%s*",
-              meth->return_type,
-              protocol_name,
-              meth->name,
-              protocol_name);
-      write_args(out, meth->fields, 0);
-      xprintf(out, ");\n");
-    }
+/*
+  In concurrent mode, items are pushed onto the allocation chain with a
+  compare-and-swap, and the hash tables are guarded by spinlocks. Otherwise,
+  the locking functions are not generated and the ASTROCOL_LOCK/UNLOCK
+  macros expand to nothing.
+ */
+static void define_chain_funs(FILE* out) {
+  if (concurrent_context) {
+    xprintf(out,
+            "static void astrocol_push(%s_context_t* context, %s* item) {\n"
+            "  %s* head = __atomic_load_n(&context->last, __ATOMIC_RELAXED);\n"
+            "  do item->gc_next = head;\n"
+            "  while (!__atomic_compare_exchange_n(&context->last, &head, item,"
+            " 1,\n"
+            "                                      __ATOMIC_RELEASE,"
+            " __ATOMIC_RELAXED));\n"
+            "  if (!head) context->first = item;\n"
+            "}\n"
+            "static void astrocol_lock(int* lock) {\n"
+            "  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))\n"
+            "    while (__atomic_load_n(lock, __ATOMIC_RELAXED));\n"
+            "}\n"
+            "static void astrocol_unlock(int* lock) {\n"
+            "  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);\n"
+            "}\n"
+            "#define ASTROCOL_LOCK(context, table) \\\n"
+            "  astrocol_lock(&(context)->table##_lock)\n"
+            "#define ASTROCOL_UNLOCK(context, table) \\\n"
+            "  astrocol_unlock(&(context)->table##_lock)\n",
+            protocol_name, protocol_name, protocol_name);
+  } else {
+    xprintf(out,
+            "static void astrocol_push(%s_context_t* context, %s* item) {\n"
+            "  if (!context->last) context->first = item;\n"
+            "  item->gc_next = context->last;\n"
+            "  context->last = item;\n"
+            "}\n"
+            "#define ASTROCOL_LOCK(context, table) ((void)0)\n"
+            "#define ASTROCOL_UNLOCK(context, table) ((void)0)\n",
+            protocol_name, protocol_name);
   }
-}
 
-static void declare_method_impls(FILE* out) {
-  on_each_elt(out, declare_element_method_impls);
+  /* Memory remembers the context it was allocated in; after that context
+   * has been merged into another, the latter owns it.
+   */
+  xprintf(out,
+          "static %s_context_t* astrocol_owner(%s_context_t* context) {\n"
+          "  while (context->merged) context = context->merged;\n"
+          "  return context;\n"
+          "}\n",
+          protocol_name, protocol_name);
 }
 
-static void declare_element_types(FILE* out) {
+static void define_element_names(FILE* out) {
   element* elt;
 
+  xprintf(out, "static const char* const astrocol_element_names[] = {\n");
   for (elt = elements; elt; elt = elt->next)
+    xprintf(out, "  \"%s\",\n", elt->name);
+  xprintf(out, "};\n");
+}
+
+/*
+  The counters of each element live at its index; the last set counts memory
+  from the allocation functions, which includes the string arenas and the
+  blocks holding cloned and loaded trees.
+ */
+static void define_statistics_funs(FILE* out) {
+  xprintf(out,
+          "#define ASTROCOL_STATS_MEMORY (%s_STATS_COUNT - 1)\n"
+          "static void astrocol_count(%s_context_t* context, unsigned ix,\n"
+          "                           size_t bytes, int alloc) {\n"
+          "  %s_stats_t* stats = &context->stats[ix];\n",
+          protocol_name, protocol_name, protocol_name);
+  if (concurrent_context)
     xprintf(out,
-            "typedef struct %s_s %s_t;\n",
-            elt->name, elt->name);
+            "  if (alloc) {\n"
+            "    __atomic_fetch_add(&stats->live, 1, __ATOMIC_RELAXED);\n"
+            "    __atomic_fetch_add(&stats->total, 1, __ATOMIC_RELAXED);\n"
+            "    __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);\n"
+            "  } else {\n"
+            "    __atomic_fetch_sub(&stats->live, 1, __ATOMIC_RELAXED);\n"
+            "    __atomic_fetch_sub(&stats->bytes, bytes, __ATOMIC_RELAXED);\n"
+            "  }\n");
+  else
+    xprintf(out,
+            "  if (alloc) {\n"
+            "    ++stats->live;\n"
+            "    ++stats->total;\n"
+            "    stats->bytes += bytes;\n"
+            "  } else {\n"
+            "    --stats->live;\n"
+            "    stats->bytes -= bytes;\n"
+            "  }\n");
+  xprintf(out,
+          "}\n"
+          "size_t %s_get_stats(%s_CONTEXT_T* context_, %s_stats_t* stats) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  size_t i;\n"
+          "  for (i = 0; i < %s_STATS_COUNT; ++i) {\n"
+          "    stats[i] = context->stats[i];\n"
+          "    stats[i].name = i < ASTROCOL_STATS_MEMORY?\n"
+          "      astrocol_element_names[i] : \"(memory)\";\n"
+          "  }\n"
+          "  return %s_STATS_COUNT;\n"
+          "}\n"
+          "void %s_dump_stats(%s_CONTEXT_T* context, FILE* out) {\n"
+          "  %s_stats_t stats[%s_STATS_COUNT];\n"
+          "  size_t i;\n"
+          "  %s_get_stats(context, stats);\n"
+          "  fprintf(out, \"%%-24s %%12s %%12s %%14s\\n\",\n"
+          "          \"element\", \"live\", \"total\", \"bytes\");\n"
+          "  for (i = 0; i < %s_STATS_COUNT; ++i)\n"
+          "    fprintf(out, \"%%-24s %%12lu %%12lu %%14lu\\n\", stats[i].name,\n"
+          "            (unsigned long)stats[i].live,"
+          " (unsigned long)stats[i].total,\n"
+          "            (unsigned long)stats[i].bytes);\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name);
 }
 
-static void define_element_vtable(FILE* out, element* elt) {
+/*
+  Counts are kept per element and method in a global table, since dispatch
+  has no context to hand; they are added atomically where the compiler
+  allows, so that concurrent traversals can be profiled. Ticks are TSC cycles
+  on x86 and nanoseconds elsewhere.
+ */
+static void define_dispatch_profile(FILE* out) {
   method* meth;
-  unsigned ix = 0;
-  method_impl impl;
 
   xprintf(out,
-          "static const %s_vtable %s_vtable = {\n",
-          protocol_name, elt->name);
-  for (meth = methods; meth; meth = meth->next, ++ix) {
-    impl = elt->implementations[ix];
-    if (mit_undefined == impl.type) {
-      xprintf(out, "  NULL,\n");
-    } else {
-      /* Explicitly cast to suppress warnings */
-      xprintf(out,
-              "  (%s (*)(%s*",
-              meth->return_type,
-              protocol_name);
-      write_args(out, meth->fields, 0);
-      xprintf(out, ")) %s_%s,\n",
-              get_implementor_name(meth, ix, elt),
+          "%s_dispatch_count_t %s_dispatch_profile[%u][%u];\n"
+          "static const char* const astrocol_method_names[] = {\n",
+          protocol_name, protocol_name, count_elements(), count_methods());
+  for (meth = methods; meth; meth = meth->next)
+    xprintf(out, "  \"%s\",\n", meth->name);
+  xprintf(out,
+          "};\n"
+          "#ifdef __GNUC__\n"
+          "#define ASTROCOL_PROFILE_ADD(var, n) \\\n"
+          "  __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)\n"
+          "#define ASTROCOL_PROFILE_GET(var) \\\n"
+          "  __atomic_load_n(&(var), __ATOMIC_RELAXED)\n"
+          "#else\n"
+          "#define ASTROCOL_PROFILE_ADD(var, n) ((var) += (n))\n"
+          "#define ASTROCOL_PROFILE_GET(var) (var)\n"
+          "#endif\n");
+  if (profile_timing)
+    xprintf(out,
+            "#if defined(__GNUC__) && (defined(__x86_64__) ||"
+            " defined(__i386__))\n"
+            "#define ASTROCOL_TICKS() ((unsigned long long)"
+            "__builtin_ia32_rdtsc())\n"
+            "#else\n"
+            "#include <time.h>\n"
+            "static unsigned long long astrocol_ticks(void) {\n"
+            "  struct timespec ts;\n"
+            "  clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+            "  return ts.tv_sec * 1000000000ull + ts.tv_nsec;\n"
+            "}\n"
+            "#define ASTROCOL_TICKS() astrocol_ticks()\n"
+            "#endif\n");
+  xprintf(out,
+          "void %s_write_dispatch_profile(FILE* out) {\n"
+          "  unsigned e, m;\n"
+          "  unsigned long long calls;\n"
+          "  for (e = 0; e < %s_DISPATCH_ELEMENTS; ++e) {\n"
+          "    for (m = 0; m < %s_DISPATCH_METHODS; ++m) {\n"
+          "      calls =\n"
+          "        ASTROCOL_PROFILE_GET(%s_dispatch_profile[e][m].calls);\n"
+          "      if (calls)\n"
+          "        fprintf(out, \"%%s %%s %%llu %%llu\\n\",\n"
+          "                astrocol_element_names[e], astrocol_method_names[m],"
+          " calls,\n"
+          "                ASTROCOL_PROFILE_GET("
+          "%s_dispatch_profile[e][m].ticks));\n"
+          "    }\n"
+          "  }\n"
+          "}\n"
+          "void %s_reset_dispatch_profile(void) {\n"
+          "  memset(%s_dispatch_profile, 0, sizeof(%s_dispatch_profile));\n"
+          "}\n",
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name);
+}
+
+/*
+  Every site_sampling-th construction in a context is recorded against its
+  element and the block of ASTROCOL_SITE_LINES source lines it starts in.
+  The table is keyed on both; an entry with no samples is empty.
+ */
+static void define_site_funs(FILE* out) {
+  /* Adding a site reports a failure to grow the table rather than calling
+   * oom, so that the sampler can release the sites lock first.
+   */
+  xprintf(out,
+          "#ifndef ASTROCOL_SITE_LINES\n"
+          "#define ASTROCOL_SITE_LINES 64\n"
+          "#endif\n"
+          "#define ASTROCOL_SITE_INTERVAL %uu\n"
+          "static %s_site_t* astrocol_site_slot(%s_site_t* sites,"
+          " size_t mask,\n"
+          "                                  long first_line,"
+          " unsigned element) {\n"
+          "  size_t ix = ((size_t)first_line * 31 + element) & mask;\n"
+          "  while (sites[ix].samples &&\n"
+          "         (sites[ix].first_line != first_line ||\n"
+          "          sites[ix].element != element))\n"
+          "    ix = (ix+1) & mask;\n"
+          "  return sites + ix;\n"
+          "}\n"
+          "static int astrocol_site_add(%s_context_t* context,"
+          " const %s_site_t* site) {\n"
+          "  %s_site_t* sites, * slot;\n"
+          "  size_t size, i;\n"
+          "  if (!context->sites || context->site_count*2 >= context->site_mask)"
+          " {\n"
+          "    size = context->sites? (context->site_mask+1)*2 : 64;\n"
+          "    sites = calloc(size, sizeof(%s_site_t));\n"
+          "    if (!sites) return 1;\n"
+          "    for (i = 0; context->sites && i <= context->site_mask; ++i)\n"
+          "      if (context->sites[i].samples)\n"
+          "        *astrocol_site_slot(sites, size-1,"
+          " context->sites[i].first_line,\n"
+          "                            context->sites[i].element) =\n"
+          "          context->sites[i];\n"
+          "    free(context->sites);\n"
+          "    context->sites = sites;\n"
+          "    context->site_mask = size-1;\n"
+          "  }\n"
+          "  slot = astrocol_site_slot(context->sites, context->site_mask,\n"
+          "                            site->first_line, site->element);\n"
+          "  if (!slot->samples) {\n"
+          "    slot->first_line = site->first_line;\n"
+          "    slot->element = site->element;\n"
+          "    ++context->site_count;\n"
+          "  }\n"
+          "  slot->samples += site->samples;\n"
+          "  slot->bytes += site->bytes;\n"
+          "  return 0;\n"
+          "}\n",
+          site_sampling,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name);
+
+  xprintf(out,
+          "static void astrocol_sample_site(%s_context_t* context,"
+          " unsigned element,\n"
+          "                                 long line, size_t bytes) {\n"
+          "  %s_site_t site;\n"
+          "  if (%s %% ASTROCOL_SITE_INTERVAL)\n"
+          "    return;\n"
+          "  site.first_line = line > 0?\n"
+          "    (line-1) / ASTROCOL_SITE_LINES * ASTROCOL_SITE_LINES + 1 : 0;\n"
+          "  site.element = element;\n"
+          "  site.samples = 1;\n"
+          "  site.bytes = bytes;\n"
+          "  ASTROCOL_LOCK(context, sites);\n"
+          "  if (astrocol_site_add(context, &site)) {\n"
+          "    ASTROCOL_UNLOCK(context, sites);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  ASTROCOL_UNLOCK(context, sites);\n"
+          "}\n",
+          protocol_name, protocol_name,
+          concurrent_context?
+          "__atomic_add_fetch(&context->site_counter, 1, __ATOMIC_RELAXED)" :
+          "++context->site_counter");
+
+  /* The report merges the entries for each block of lines, naming the
+   * element which takes the most memory there.
+   */
+  xprintf(out,
+          "static int astrocol_site_by_line(const void* va, const void* vb) {\n"
+          "  const %s_site_t* a = va, * b = vb;\n"
+          "  if (a->first_line != b->first_line)\n"
+          "    return a->first_line < b->first_line? -1 : 1;\n"
+          "  return a->bytes > b->bytes? -1 : a->bytes < b->bytes;\n"
+          "}\n"
+          "static int astrocol_site_by_bytes(const void* va,"
+          " const void* vb) {\n"
+          "  const %s_site_t* a = va, * b = vb;\n"
+          "  if (a->bytes != b->bytes)\n"
+          "    return a->bytes > b->bytes? -1 : 1;\n"
+          "  return a->first_line < b->first_line? -1 :"
+          " a->first_line > b->first_line;\n"
+          "}\n"
+          "void %s_write_site_report(%s_CONTEXT_T* context_, FILE* out,\n"
+          "                          unsigned top) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  %s_site_t* sites;\n"
+          "  size_t i, n = 0, regions = 0;\n"
+          "  ASTROCOL_LOCK(context, sites);\n"
+          "  sites = malloc((context->site_count? context->site_count : 1) *\n"
+          "                 sizeof(%s_site_t));\n"
+          "  if (!sites) {\n"
+          "    ASTROCOL_UNLOCK(context, sites);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  for (i = 0; context->sites && i <= context->site_mask; ++i)\n"
+          "    if (context->sites[i].samples)\n"
+          "      sites[n++] = context->sites[i];\n"
+          "  ASTROCOL_UNLOCK(context, sites);\n"
+          "  qsort(sites, n, sizeof(%s_site_t), astrocol_site_by_line);\n"
+          "  for (i = 0; i < n; ++i) {\n"
+          "    if (regions && sites[regions-1].first_line =="
+          " sites[i].first_line) {\n"
+          "      sites[regions-1].samples += sites[i].samples;\n"
+          "      sites[regions-1].bytes += sites[i].bytes;\n"
+          "    } else {\n"
+          "      sites[regions++] = sites[i];\n"
+          "    }\n"
+          "  }\n"
+          "  qsort(sites, regions, sizeof(%s_site_t),"
+          " astrocol_site_by_bytes);\n"
+          "  fprintf(out, \"%%-17s %%14s %%10s  %%s\\n\",\n"
+          "          \"lines\", \"bytes\", \"samples\", \"largest\");\n"
+          "  for (i = 0; i < regions && i < top; ++i)\n"
+          "    fprintf(out, \"%%8ld-%%-8ld %%14lu %%10lu  %%s\\n\",\n"
+          "            sites[i].first_line,\n"
+          "            sites[i].first_line + ASTROCOL_SITE_LINES - 1,\n"
+          "            (unsigned long)sites[i].bytes * ASTROCOL_SITE_INTERVAL,\n"
+          "            (unsigned long)sites[i].samples,\n"
+          "            astrocol_element_names[sites[i].element]);\n"
+          "  free(sites);\n"
+          "}\n",
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name);
+}
+
+static void define_hash_funs(FILE* out) {
+  /* FNV-1a over bytes; child hashes are folded in as whole words */
+  xprintf(out,
+          "#define ASTROCOL_HASH_SEED ((size_t)2166136261u)\n"
+          "static size_t astrocol_hash_bytes(size_t h, const void* vdata,\n"
+          "                                  size_t n) {\n"
+          "  const unsigned char* data = vdata;\n"
+          "  while (n--) {\n"
+          "    h ^= *data++;\n"
+          "    h *= (size_t)16777619u;\n"
+          "  }\n"
+          "  return h;\n"
+          "}\n");
+
+  if (!uses_impl_type(mit_structural_hash) &&
+      !uses_impl_type(mit_cached_structural_hash) &&
+      !uses_interning())
+    return;
+
+  xprintf(out,
+          "static size_t astrocol_hash_mix(size_t h, size_t v) {\n"
+          "  return astrocol_hash_bytes(h, &v, sizeof(v));\n"
+          "}\n"
+          "static size_t astrocol_hash_string(size_t h, const char* str) {\n"
+          "  if (!str) return astrocol_hash_mix(h, 0);\n"
+          "  return astrocol_hash_bytes(h, str, strlen(str) + 1);\n"
+          "}\n");
+  if (uses_slices())
+    xprintf(out,
+            "static size_t astrocol_hash_slice(size_t h, %s_slice slice) {\n"
+            "  h = astrocol_hash_mix(h, slice.len);\n"
+            "  return astrocol_hash_bytes(h, slice.str, slice.len);\n"
+            "}\n",
+            protocol_name);
+}
+
+static void define_hash_table_funs(FILE* out) {
+  /* Open addressing with linear probing; a NULL value marks an empty slot. */
+  xprintf(out,
+          "static void* astrocol_table_find(%s_hash_table* table, size_t hash,\n"
+          "                                 int (*eq)(const void*, const void*),\n"
+          "                                 const void* key) {\n"
+          "  size_t ix;\n"
+          "  if (!table->slots) return NULL;\n"
+          "  for (ix = hash & table->mask; table->slots[ix].value;\n"
+          "       ix = (ix+1) & table->mask)\n"
+          "    if (hash == table->slots[ix].hash &&\n"
+          "        (*eq)(table->slots[ix].value, key))\n"
+          "      return table->slots[ix].value;\n"
+          "  return NULL;\n"
+          "}\n",
+          protocol_name);
+  xprintf(out,
+          "static void astrocol_table_put(%s_hash_slot* slots, size_t mask,\n"
+          "                               size_t hash, void* value) {\n"
+          "  size_t ix;\n"
+          "  for (ix = hash & mask; slots[ix].value; ix = (ix+1) & mask);\n"
+          "  slots[ix].hash = hash;\n"
+          "  slots[ix].value = value;\n"
+          "}\n",
+          protocol_name);
+  /* Returns nonzero if the table could not grow, rather than calling oom,
+   * since callers may hold a lock that must be released first.
+   */
+  xprintf(out,
+          "static int astrocol_table_insert(%s_context_t* context,\n"
+          "                                 %s_hash_table* table,\n"
+          "                                 size_t hash, void* value) {\n"
+          "  %s_hash_slot* slots;\n"
+          "  size_t ix, size;\n"
+          "  (void)context;\n"
+          "  if (!table->slots || table->count*2 >= table->mask) {\n"
+          "    size = table->slots? (table->mask+1)*2 : 64;\n"
+          "%s"
+          "    slots = calloc(size, sizeof(%s_hash_slot));\n"
+          "    if (!slots) return 1;\n"
+          "    if (table->slots) {\n"
+          "      for (ix = 0; ix <= table->mask; ++ix)\n"
+          "        if (table->slots[ix].value)\n"
+          "          astrocol_table_put(slots, size-1, table->slots[ix].hash,\n"
+          "                             table->slots[ix].value);\n"
+          "      free(table->slots);\n"
+          "    }\n"
+          "    table->slots = slots;\n"
+          "    table->mask = size-1;\n"
+          "  }\n"
+          "  astrocol_table_put(table->slots, table->mask, hash, value);\n"
+          "  ++table->count;\n"
+          "  return 0;\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name,
+          memory_budget?
+          "    if (astrocol_try_charge(context, size * sizeof(*slots)))\n"
+          "      return 1;\n" : "",
+          protocol_name);
+  /* Removal shifts later members of the cluster back into the hole, unless
+   * that would move them before their home slot.
+   */
+  xprintf(out,
+          "static void astrocol_table_remove_at(%s_hash_table* table,"
+          " size_t ix) {\n"
+          "  size_t next, home;\n"
+          "  for (next = (ix+1) & table->mask; table->slots[next].value;\n"
+          "       next = (next+1) & table->mask) {\n"
+          "    home = table->slots[next].hash & table->mask;\n"
+          "    if (ix <= next? home <= ix || home > next :"
+          " home <= ix && home > next) {\n"
+          "      table->slots[ix] = table->slots[next];\n"
+          "      ix = next;\n"
+          "    }\n"
+          "  }\n"
+          "  table->slots[ix].hash = 0;\n"
+          "  table->slots[ix].value = NULL;\n"
+          "  --table->count;\n"
+          "}\n"
+          "static void astrocol_table_purge(%s_hash_table* table,\n"
+          "                                 const char* begin, const char* end)"
+          " {\n"
+          "  size_t ix = 0;\n"
+          "  if (!table->slots) return;\n"
+          "  while (ix <= table->mask) {\n"
+          "    if ((const char*)table->slots[ix].value >= begin &&\n"
+          "        (const char*)table->slots[ix].value < end)\n"
+          "      astrocol_table_remove_at(table, ix);\n"
+          "    else\n"
+          "      ++ix;\n"
+          "  }\n"
+          "}\n",
+          protocol_name, protocol_name);
+  if (uses_interning())
+    xprintf(out,
+            "static void astrocol_table_remove(%s_hash_table* table,"
+            " size_t hash,\n"
+            "                                  const void* value) {\n"
+            "  size_t ix;\n"
+            "  if (!table->slots) return;\n"
+            "  for (ix = hash & table->mask; table->slots[ix].value;\n"
+            "       ix = (ix+1) & table->mask) {\n"
+            "    if (value == table->slots[ix].value) {\n"
+            "      astrocol_table_remove_at(table, ix);\n"
+            "      return;\n"
+            "    }\n"
+            "  }\n"
+            "}\n",
+            protocol_name);
+}
+
+static const char* get_implementor_name(method* meth,
+                                        unsigned ix,
+                                        element* elt) {
+  /* If not "implemented by" the protocol, that field is always correct. */
+  if (strcmp(protocol_name, elt->implementations[ix].implemented_by))
+    return elt->implementations[ix].implemented_by;
+
+  /* Each element actually implements methods provided by the protocol, unless
+   * the protocol provides a custom default.
+   */
+  if (mit_custom == elt->implementations[ix].type)
+    return protocol_name;
+  else
+    return elt->name;
+}
+
+static void declare_element_method_impls(FILE* out, element* elt) {
+  method* meth;
+  unsigned i = 0;
+
+  for (meth = methods; meth; meth = meth->next, ++i) {
+    /* Only need to declare something if a version specific to this element
+     * must be generated.
+     */
+    if (mit_undefined != elt->implementations[i].type &&
+        !strcmp(elt->name, get_implementor_name(meth, i, elt))) {
+      xprintf(out,
+              "extern %s %s_%s(%s_t*",
+              meth->return_type,
+              elt->name,
+              meth->name,
+              elt->name);
+      write_args(out, meth->fields, 0);
+      switch (method_heat(elt, i)) {
+      case 1:  xprintf(out, ") ASTROCOL_HOT;\n"); break;
+      case -1: xprintf(out, ") ASTROCOL_COLD;\n"); break;
+      default: xprintf(out, ");\n"); break;
+      }
+    }
+  }
+}
+
+static void declare_protocol_custom_defaults(FILE* out) {
+  method* meth;
+
+  for (meth = methods; meth; meth = meth->next) {
+    if (mit_custom == meth->default_impl.type) {
+      xprintf(out,
+              "extern %s %s_%s(%s*",
+              meth->return_type,
+              protocol_name,
+              meth->name,
+              protocol_name);
+      write_args(out, meth->fields, 0);
+      xprintf(out, ");\n");
+    }
+  }
+}
+
+static void declare_method_impls(FILE* out) {
+  on_each_elt(out, declare_element_method_impls);
+}
+
+static void declare_element_types(FILE* out) {
+  element* elt;
+
+  for (elt = elements; elt; elt = elt->next)
+    xprintf(out,
+            "typedef struct %s_s %s_t;\n",
+            elt->name, elt->name);
+}
+
+static void define_element_vtable(FILE* out, element* elt) {
+  method* meth;
+  unsigned ix = 0;
+  method_impl impl;
+
+  xprintf(out,
+          "static const %s_vtable %s_vtable = {\n",
+          protocol_name, elt->name);
+  for (meth = methods; meth; meth = meth->next, ++ix) {
+    impl = elt->implementations[ix];
+    if (mit_undefined == impl.type) {
+      xprintf(out, "  NULL,\n");
+    } else {
+      /* Explicitly cast to suppress warnings */
+      xprintf(out,
+              "  (%s (*)(%s*",
+              meth->return_type,
+              protocol_name);
+      write_args(out, meth->fields, 0);
+      xprintf(out, ")) %s_%s,\n",
+              get_implementor_name(meth, ix, elt),
               meth->name);
     }
   }
 
+  xprintf(out, "  %u,\n", element_index(elt));
+  if (uses_interning())
+    xprintf(out, "  %d,\n", elt->is_interned);
+
   xprintf(out, "};\n");
 }
 
@@ -362,9 +1505,14 @@ static void define_element_members(FILE* out, field* head) {
 
   define_element_members(out, head->next);
 
-  xprintf(out,
-          "  %s %s;\n",
-          head->type, head->name);
+  if (is_protocol_sequence(head->type))
+    xprintf(out,
+            "  %s_seq %s;\n",
+            protocol_name, head->name);
+  else
+    xprintf(out,
+            "  %s %s;\n",
+            head->type, head->name);
 }
 
 static void define_element_type(FILE* out, element* elt) {
@@ -380,53 +1528,38 @@ static void define_element_types(FILE* out) {
   on_each_elt(out, define_element_type);
 }
 
-static int skip_whitespace(const char** str) {
-  while (isspace(**str))
-    ++*str;
+static int uses_strings(void) {
+  element* elt;
+  field* f;
+
+  for (elt = elements; elt; elt = elt->next)
+    for (f = elt->members; f; f = f->next)
+      if (is_string(f->type))
+        return 1;
 
-  return 1;
+  return 0;
 }
 
-static int scan_str(const char** str, const char* target) {
-  while (*target)
-    if (**str == *target)
-      ++*str, ++target;
-    else
-      return 0;
+static int uses_slices(void) {
+  element* elt;
+  field* f;
 
-  return 1;
-}
+  for (elt = elements; elt; elt = elt->next)
+    for (f = elt->members; f; f = f->next)
+      if (is_slice(f->type))
+        return 1;
 
-static int is_protocol_instance(const char* type) {
-  return
-    skip_whitespace(&type) &&
-    scan_str(&type, protocol_name) &&
-    skip_whitespace(&type) &&
-    scan_str(&type, "*") &&
-    skip_whitespace(&type) &&
-    !*type;
+  return 0;
 }
 
-static int is_void(const char* type) {
-  return
-    skip_whitespace(&type) &&
-    scan_str(&type, "void") &&
-    skip_whitespace(&type) &&
-    !*type;
-}
+static int has_sequence(element* elt) {
+  field* f;
 
-static int is_string(const char* type) {
-  /* Optional leading const */
-  skip_whitespace(&type);
-  scan_str(&type, "const");
-  skip_whitespace(&type);
+  for (f = elt->members; f; f = f->next)
+    if (is_protocol_sequence(f->type))
+      return 1;
 
-  return
-    scan_str(&type, "char") &&
-    skip_whitespace(&type) &&
-    scan_str(&type, "*") &&
-    skip_whitespace(&type) &&
-    !*type;
+  return 0;
 }
 
 static void write_callsite_args(FILE* out, field* field) {
@@ -447,10 +1580,21 @@ static void gen_impl_recursive_for_member(FILE* out, method* meth,
     xprintf(out, "  %s(this->%s", meth->name, member->name);
     write_callsite_args(out, meth->fields);
     xprintf(out, ");\n");
+  } else if (is_protocol_sequence(member->type)) {
+    xprintf(out,
+            "for (astrocol_i = 0; astrocol_i < this->%s.count; ++astrocol_i)\n"
+            "  if (this->%s.items[astrocol_i])\n"
+            "    %s(this->%s.items[astrocol_i]",
+            member->name, member->name, meth->name, member->name);
+    write_callsite_args(out, meth->fields);
+    xprintf(out, ");\n");
   }
 }
 
 static void gen_impl_recursive(FILE* out, method* meth, element* elt) {
+  if (has_sequence(elt))
+    xprintf(out, "unsigned astrocol_i;\n");
+
   gen_impl_recursive_for_member(out, meth, elt->members);
 }
 
@@ -502,6 +1646,19 @@ static void gen_impl_graphviz_node_for_member(FILE* out, method* meth,
     xprintf(out, "      fputc(*str, out);\n");
     xprintf(out, "  if (!this->%s)\n", member->name);
     xprintf(out, "    fprintf(out, \"<b>NULL</b>\");\n");
+  } else if (is_slice(member->type)) {
+    xprintf(out, "  for (str = this->%s.str;\n", member->name);
+    xprintf(out, "       str && str < this->%s.str + this->%s.len; ++str)\n",
+            member->name, member->name);
+    xprintf(out, "    if (strchr(\"<>&\\\"\", *str) || !*str)\n");
+    xprintf(out, "      fprintf(out, \"&#x%%02x\", (unsigned int)*str);\n");
+    xprintf(out, "    else\n");
+    xprintf(out, "      fputc(*str, out);\n");
+    xprintf(out, "  if (!this->%s.str)\n", member->name);
+    xprintf(out, "    fprintf(out, \"<b>NULL</b>\");\n");
+  } else if (is_protocol_sequence(member->type)) {
+    xprintf(out, "  fprintf(out, \"[%%u]\", this->%s.count);\n",
+            member->name);
   } else {
     xprintf(out, "  fprintf(out, \"%%llX\", (unsigned long long)this->%s);\n",
             member->name);
@@ -523,6 +1680,19 @@ static void gen_impl_graphviz_edge_for_member(FILE* out, method* meth,
             " this, this->%s);\n", member->name, member->name);
     xprintf(out, "    %s(this->%s, out);\n", meth->name, member->name);
     xprintf(out, "  }\n");
+  } else if (is_protocol_sequence(member->type)) {
+    xprintf(out,
+            "  for (astrocol_i = 0; astrocol_i < this->%s.count; ++astrocol_i)"
+            " {\n"
+            "    if (!this->%s.items[astrocol_i]) continue;\n",
+            member->name, member->name);
+    xprintf(out, "    fprintf(out, \"\\\"%%p\\\" -> \\\"%%p\\\""
+            "[label=\\\"%s[%%u]\\\"];\\n\","
+            " this, this->%s.items[astrocol_i], astrocol_i);\n",
+            member->name, member->name);
+    xprintf(out, "    %s(this->%s.items[astrocol_i], out);\n",
+            meth->name, member->name);
+    xprintf(out, "  }\n");
   }
 }
 
@@ -530,11 +1700,13 @@ static void gen_impl_graphviz(FILE* out, method* meth, element* elt) {
   /* We need to declare a "str" variable if any member is a string */
   field* mem;
   for (mem = elt->members; mem; mem = mem->next) {
-    if (is_string(mem->type)) {
+    if (is_string(mem->type) || is_slice(mem->type)) {
       xprintf(out, "  const char* str;\n");
       break;
     }
   }
+  if (has_sequence(elt))
+    xprintf(out, "  unsigned astrocol_i;\n");
 
   xprintf(out, "  fprintf(out, \"\\\"%%p\\\" [shape=box,label=<\", this);\n");
   xprintf(out, "  fprintf(out, \"<u>%s</u><br />\");\n", elt->name);
@@ -543,6 +1715,153 @@ static void gen_impl_graphviz(FILE* out, method* meth, element* elt) {
   gen_impl_graphviz_edge_for_member(out, meth, elt->members);
 }
 
+static void gen_impl_structural_hash_for_member(FILE* out, method* meth,
+                                                field* member) {
+  if (!member) return;
+
+  gen_impl_structural_hash_for_member(out, meth, member->next);
+
+  /* Internal fields (including hash caches) are not part of the structure */
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type)) {
+    xprintf(out,
+            "  astrocol_h = astrocol_hash_mix(astrocol_h,\n"
+            "    this->%s? (size_t)%s(this->%s) : 0);\n",
+            member->name, meth->name, member->name);
+  } else if (is_protocol_sequence(member->type)) {
+    xprintf(out,
+            "  astrocol_h = astrocol_hash_mix(astrocol_h, this->%s.count);\n"
+            "  for (astrocol_i = 0; astrocol_i < this->%s.count; ++astrocol_i)\n"
+            "    astrocol_h = astrocol_hash_mix(astrocol_h,\n"
+            "      this->%s.items[astrocol_i]?\n"
+            "      (size_t)%s(this->%s.items[astrocol_i]) : 0);\n",
+            member->name, member->name, member->name,
+            meth->name, member->name);
+  } else if (is_string(member->type)) {
+    xprintf(out,
+            "  astrocol_h = astrocol_hash_string(astrocol_h, this->%s);\n",
+            member->name);
+  } else if (is_slice(member->type)) {
+    xprintf(out,
+            "  astrocol_h = astrocol_hash_slice(astrocol_h, this->%s);\n",
+            member->name);
+  } else {
+    xprintf(out,
+            "  astrocol_h = astrocol_hash_bytes(astrocol_h, &this->%s,\n"
+            "                                   sizeof(this->%s));\n",
+            member->name, member->name);
+  }
+}
+
+static void gen_impl_structural_hash(FILE* out, method* meth, element* elt) {
+  xprintf(out, "  size_t astrocol_h;\n");
+  if (has_sequence(elt))
+    xprintf(out, "  unsigned astrocol_i;\n");
+
+  if (mit_cached_structural_hash == elt->implementations[
+        method_index(meth)].type)
+    xprintf(out,
+            "  if (this->_%s_cache) return this->_%s_cache;\n",
+            meth->name, meth->name);
+
+  /* The element name stands in for its identity, since unlike the vtable
+   * address it is the same in every process.
+   */
+  xprintf(out,
+          "  astrocol_h = astrocol_hash_string(ASTROCOL_HASH_SEED, \"%s\");\n",
+          elt->name);
+  gen_impl_structural_hash_for_member(out, meth, elt->members);
+
+  if (mit_cached_structural_hash == elt->implementations[
+        method_index(meth)].type)
+    /* Zero means "not yet computed", so it can never be a cached value */
+    xprintf(out,
+            "  if (!(%s)astrocol_h) astrocol_h = 1;\n"
+            "  this->_%s_cache = (%s)astrocol_h;\n",
+            meth->return_type, meth->name, meth->return_type);
+
+  xprintf(out, "  return (%s)astrocol_h;\n", meth->return_type);
+}
+
+static void gen_impl_structural_equals_for_member(FILE* out, method* meth,
+                                                  field* member) {
+  if (!member) return;
+
+  gen_impl_structural_equals_for_member(out, meth, member->next);
+
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type)) {
+    xprintf(out,
+            "  if (this->%s != that->%s &&\n"
+            "      (!this->%s || !that->%s ||\n"
+            "       !%s(this->%s, that->%s)))\n"
+            "    return (%s)0;\n",
+            member->name, member->name,
+            member->name, member->name,
+            meth->name, member->name, member->name,
+            meth->return_type);
+  } else if (is_protocol_sequence(member->type)) {
+    xprintf(out,
+            "  if (this->%s.count != that->%s.count) return (%s)0;\n"
+            "  for (astrocol_i = 0; astrocol_i < this->%s.count; ++astrocol_i)\n"
+            "    if (this->%s.items[astrocol_i] != that->%s.items[astrocol_i] &&\n"
+            "        (!this->%s.items[astrocol_i] ||\n"
+            "         !that->%s.items[astrocol_i] ||\n"
+            "         !%s(this->%s.items[astrocol_i],\n"
+            "             that->%s.items[astrocol_i])))\n"
+            "      return (%s)0;\n",
+            member->name, member->name, meth->return_type,
+            member->name,
+            member->name, member->name,
+            member->name,
+            member->name,
+            meth->name, member->name,
+            member->name,
+            meth->return_type);
+  } else if (is_string(member->type)) {
+    xprintf(out,
+            "  if (!astrocol_string_equals(this->%s, that->%s))\n"
+            "    return (%s)0;\n",
+            member->name, member->name, meth->return_type);
+  } else if (is_slice(member->type)) {
+    xprintf(out,
+            "  if (!astrocol_slice_equals(this->%s, that->%s))\n"
+            "    return (%s)0;\n",
+            member->name, member->name, meth->return_type);
+  } else {
+    xprintf(out,
+            "  if (memcmp(&this->%s, &that->%s, sizeof(this->%s)))\n"
+            "    return (%s)0;\n",
+            member->name, member->name, member->name, meth->return_type);
+  }
+}
+
+static void gen_impl_structural_equals(FILE* out, method* meth,
+                                       element* elt) {
+  /* The method's sole argument is the instance to compare against */
+  xprintf(out, "  %s_t* that = (%s_t*)%s;\n",
+          elt->name, elt->name, meth->fields->name);
+  if (has_sequence(elt))
+    xprintf(out, "  unsigned astrocol_i;\n");
+
+  xprintf(out,
+          "  if (this == that) return (%s)1;\n",
+          meth->return_type);
+  /* A lazily-loaded instance only has its real vtable once decoded */
+  if (generate_snapshots)
+    xprintf(out,
+            "  if (that) %s_materialise((%s*)that);\n",
+            protocol_name, protocol_name);
+  xprintf(out,
+          "  if (!that || this->core.vtable != that->core.vtable)\n"
+          "    return (%s)0;\n",
+          meth->return_type);
+  gen_impl_structural_equals_for_member(out, meth, elt->members);
+  xprintf(out, "  return (%s)1;\n", meth->return_type);
+}
+
 static void (*const gen_impl_funs[])(FILE*, method*, element*) = {
   gen_impl_recursive,
   gen_impl_visit_parent,
@@ -553,6 +1872,9 @@ static void (*const gen_impl_funs[])(FILE*, method*, element*) = {
   NULL,
   NULL,
   gen_impl_graphviz,
+  gen_impl_structural_hash,
+  gen_impl_structural_hash,
+  gen_impl_structural_equals,
 };
 
 static void define_implementations_for_element(FILE* out, element* elt) {
@@ -577,20 +1899,61 @@ static void define_implementations(FILE* out) {
   on_each_elt(out, define_implementations_for_element);
 }
 
+/*
+  Writes code to make "this" the parent of the non-NULL protocol instance
+  given by expr. Interned instances may be shared, and so never get a parent.
+ */
+static void write_parent_assignment(FILE* out, const char* indent,
+                                    const char* expr) {
+  if (uses_interning())
+    xprintf(out, "%sif (%s && !%s->vtable->interned) {\n",
+            indent, expr, expr);
+  else
+    xprintf(out, "%sif (%s) {\n", indent, expr);
+
+  xprintf(out,
+          "%s  assert(!%s->parent);\n"
+          "%s  %s->parent = (%s*)this;\n"
+          "%s}\n",
+          indent, expr,
+          indent, expr, protocol_name,
+          indent);
+}
+
 static void write_element_member_initialisers(FILE* out, field* member) {
+  char item[256];
+
   for (; member; member = member->next) {
-    if (':' != member->name[0] && '_' != member->name[0]) {
+    if (is_protocol_sequence(member->type)) {
+      /* Move the builder's contents into the array following the element,
+       * then release the builder's own storage.
+       */
+      xprintf(out,
+              "  if (%s) {\n"
+              "    this->%s.count = this->%s.capacity = %s->count;\n"
+              "    memcpy(astrocol_items, %s->items,\n"
+              "           %s->count * sizeof(%s*));\n"
+              "    astrocol_seq_clear(%s);\n"
+              "  }\n"
+              "  this->%s.items = astrocol_items;\n"
+              "  astrocol_items += this->%s.count;\n"
+              "  for (astrocol_i = 0; astrocol_i < this->%s.count; ++astrocol_i)"
+              " {\n",
+              member->name, member->name, member->name, member->name,
+              member->name, member->name, protocol_name,
+              member->name,
+              member->name, member->name,
+              member->name);
+      snprintf(item, sizeof(item), "this->%s.items[astrocol_i]",
+               member->name);
+      write_parent_assignment(out, "    ", item);
+      xprintf(out, "  }\n");
+    } else if (':' != member->name[0] && '_' != member->name[0]) {
       xprintf(out, "  this->%s = %s;\n", member->name, member->name);
       /* If the member is a non-NULL protocol instance, this is now its
        * parent. */
-      if (is_protocol_instance(member->type)) {
-        xprintf(out,
-                "  if (%s) {\n"
-                "    assert(!%s->parent);\n"
-                "    %s->parent = (%s*)this;\n"
-                "  }\n",
-                member->name, member->name, member->name, protocol_name);
-      }
+      if (is_protocol_instance(member->type))
+        write_parent_assignment(out, "  ", member->name);
     }
   }
 }
@@ -600,6 +1963,7 @@ static void define_memman_funs(FILE* out) {
           "typedef struct {\n"
           "  %s prot;\n"
           "  void (*dtor)(void*);\n"
+          "%s"
           "  char data[sizeof(long)];\n"
           "} astrocol_memory;\n"
           "static void astrocol_memory_dtor(void* vthis) {\n"
@@ -607,31 +1971,248 @@ static void define_memman_funs(FILE* out) {
           "  if (this->dtor) (*this->dtor)(this->data);\n"
           "  free(this);\n"
           "}\n"
-          "void* %s_dalloc(size_t sz, void (*dtor)(void*)) {\n"
+          "static void astrocol_region_item_dtor(void* vitem) {\n"
+          "  %s* item = vitem;\n"
+          "  astrocol_memory* mem = vitem;\n"
+          "  if (!item->vtable) {\n"
+          "    if (mem->dtor) (*mem->dtor)(mem->data);\n"
+          "  } else if (item->vtable->dtor) {\n"
+          "    dtor(item);\n"
+          "  }\n"
+          "}\n"
+          "static void* astrocol_dalloc(%s_context_t* context, size_t sz,\n"
+          "                             void (*dtor)(void*)) {\n"
           "  astrocol_memory* mem;\n"
-          "  mem = astrocol_malloc(sizeof(*mem) + sz - sizeof(long));\n"
+          "  void (*mem_dtor)(void*) = astrocol_memory_dtor;\n"
+          "  mem = astrocol_alloc_item(context, sizeof(*mem) + sz - sizeof(long),\n"
+          "                            &mem_dtor);\n"
           "  memset(mem, 0, sizeof(*mem) + sz - sizeof(long));\n"
-          "  mem->prot.dtor = astrocol_memory_dtor;\n"
-          "  mem->prot.gc_next = %s_CONTEXT->last;\n"
-          "  %s_CONTEXT->last = &mem->prot;\n"
+          "  mem->prot.dtor = mem_dtor;\n"
+          "  mem->dtor = dtor;\n"
+          "%s"
+          "  astrocol_push(context, &mem->prot);\n"
           "  return mem->data;\n"
+          "}\n"
+          "void* %s_dalloc_in(%s_CONTEXT_T* context, size_t sz,\n"
+          "                   void (*dtor)(void*)) {\n"
+          "  return astrocol_dalloc((%s_context_t*)context, sz, dtor);\n"
+          "}\n"
+          "void* %s_dalloc(size_t sz, void (*dtor)(void*)) {\n"
+          "  return %s_dalloc_in(%s_context, sz, dtor);\n"
           "}\n",
           protocol_name,
+          generate_statistics? "  size_t size;\n" : "",
+          protocol_name, protocol_name,
+          generate_statistics?
+          "  mem->size = sizeof(*mem) + sz - sizeof(long);\n"
+          "  astrocol_count(context, ASTROCOL_STATS_MEMORY, mem->size, 1);\n"
+          : "",
+          protocol_name, protocol_name,
           protocol_name,
           protocol_name,
-          protocol_name);
-  xprintf(out,
-          "void* %s_malloc(size_t sz) { return %s_dalloc(sz, NULL); }\n",
           protocol_name, protocol_name);
   xprintf(out,
-          "char* %s_strdup(const char* str) {\n"
+          "void* %s_malloc_in(%s_CONTEXT_T* context, size_t sz) {\n"
+          "  return %s_dalloc_in(context, sz, NULL);\n"
+          "}\n"
+          "void* %s_malloc(size_t sz) { return %s_malloc_in(%s_context, sz); }\n",
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name, protocol_name, protocol_name);
+  xprintf(out,
+          "char* %s_strdup_in(%s_CONTEXT_T* context, const char* str) {\n"
           "  size_t n = strlen(str);\n"
-          "  char* ret = %s_malloc(n+1);\n"
+          "  char* ret = %s_malloc_in(context, n+1);\n"
           "  memcpy(ret, str, n+1);\n"
           "  return ret;\n"
+          "}\n"
+          "char* %s_strdup(const char* str) {\n"
+          "  return %s_strdup_in(%s_context, str);\n"
+          "}\n",
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name);
+  /* Interned strings are packed into shared chunks, rather than each getting
+   * its own tracked allocation.
+   */
+  xprintf(out,
+          "#define ASTROCOL_STRING_CHUNK 4096\n"
+          "typedef struct {\n"
+          "  const char* str;\n"
+          "  size_t len;\n"
+          "} astrocol_string_key;\n"
+          "static int astrocol_string_key_equals(const void* vstr,\n"
+          "                                      const void* vkey) {\n"
+          "  const char* str = vstr;\n"
+          "  const astrocol_string_key* key = vkey;\n"
+          "  size_t i;\n"
+          "  /* The interned string may be shorter than the key */\n"
+          "  for (i = 0; i < key->len; ++i)\n"
+          "    if (!str[i] || str[i] != key->str[i]) return 0;\n"
+          "  return !str[key->len];\n"
+          "}\n"
+          "typedef struct {\n"
+          "  %s_context_t* context;\n"
+          "  size_t size;\n"
+          "} astrocol_string_chunk;\n"
+          "static void astrocol_string_chunk_dtor(void* vchunk) {\n"
+          "  astrocol_string_chunk* chunk = vchunk;\n"
+          "  %s_context_t* context = astrocol_owner(chunk->context);\n"
+          "  char* begin = (char*)(chunk+1), * end = begin + chunk->size;\n"
+          "  if (context->string_arena >= begin && context->string_arena <= end)"
+          " {\n"
+          "    context->string_arena = NULL;\n"
+          "    context->string_arena_left = 0;\n"
+          "  }\n"
+          "  astrocol_table_purge(&context->strings, begin, end);\n"
+          "}\n"
+          "static char* astrocol_string_chunk_new(%s_context_t* context,"
+          " size_t size) {\n"
+          "  astrocol_string_chunk* chunk = astrocol_dalloc(\n"
+          "    context, sizeof(astrocol_string_chunk) + size,"
+          " astrocol_string_chunk_dtor);\n"
+          "  chunk->context = context;\n"
+          "  chunk->size = size;\n"
+          "  return (char*)(chunk+1);\n"
+          "}\n"
+          "const char* %s_intern_in(%s_CONTEXT_T* context_, const char* str,\n"
+          "                         size_t len) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  astrocol_string_key key;\n"
+          "  size_t h = astrocol_hash_bytes(ASTROCOL_HASH_SEED, str, len);\n"
+          "  int own = len+1 > ASTROCOL_STRING_CHUNK/4;\n"
+          "  char* ret, * chunk;\n"
+          "  key.str = str;\n"
+          "  key.len = len;\n"
+          "  ASTROCOL_LOCK(context, strings);\n"
+          "  ret = astrocol_table_find(&context->strings, h,\n"
+          "                            astrocol_string_key_equals, &key);\n"
+          "  if (ret) {\n"
+          "    ASTROCOL_UNLOCK(context, strings);\n"
+          "    return ret;\n"
+          "  }\n"
+          "  if (own || len+1 > context->string_arena_left) {\n"
+          "    /* Allocation may call oom, so the lock is not held for it, and\n"
+          "     * another thread may have added the string in the meantime.\n"
+          "     */\n"
+          "    ASTROCOL_UNLOCK(context, strings);\n"
+          "    chunk = astrocol_string_chunk_new(\n"
+          "      context, own? len+1 : ASTROCOL_STRING_CHUNK);\n"
+          "    ASTROCOL_LOCK(context, strings);\n"
+          "    if (!own) {\n"
+          "      context->string_arena = chunk;\n"
+          "      context->string_arena_left = ASTROCOL_STRING_CHUNK;\n"
+          "    }\n"
+          "%s"
+          "    if (own) ret = chunk;\n"
+          "  }\n"
+          "  if (!own) {\n"
+          "    ret = context->string_arena;\n"
+          "    context->string_arena += len+1;\n"
+          "    context->string_arena_left -= len+1;\n"
+          "  }\n"
+          "  memcpy(ret, str, len);\n"
+          "  ret[len] = 0;\n"
+          "  if (astrocol_table_insert(context, &context->strings, h, ret)) {\n"
+          "    ASTROCOL_UNLOCK(context, strings);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  ASTROCOL_UNLOCK(context, strings);\n"
+          "  return ret;\n"
+          "}\n"
+          "const char* %s_intern(const char* str, size_t len) {\n"
+          "  return %s_intern_in(%s_context, str, len);\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          concurrent_context?
+          "    ret = astrocol_table_find(&context->strings, h,\n"
+          "                              astrocol_string_key_equals, &key);\n"
+          "    if (ret) {\n"
+          "      ASTROCOL_UNLOCK(context, strings);\n"
+          "      return ret;\n"
+          "    }\n" : "",
+          protocol_name, protocol_name, protocol_name);
+  xprintf(out,
+          "typedef struct {\n"
+          "  void* buffer;\n"
+          "  void (*release)(void*);\n"
+          "} astrocol_retained;\n"
+          "static void astrocol_retained_dtor(void* vthis) {\n"
+          "  astrocol_retained* this = vthis;\n"
+          "  (*this->release)(this->buffer);\n"
+          "}\n"
+          "void %s_retain_in(%s_CONTEXT_T* context, void* buffer,\n"
+          "                  void (*release)(void*)) {\n"
+          "  astrocol_retained* this = %s_dalloc_in(\n"
+          "    context, sizeof(astrocol_retained), astrocol_retained_dtor);\n"
+          "  this->buffer = buffer;\n"
+          "  this->release = release;\n"
+          "}\n"
+          "void %s_retain(void* buffer, void (*release)(void*)) {\n"
+          "  %s_retain_in(%s_context, buffer, release);\n"
           "}\n",
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name);
+  xprintf(out,
+          "static void astrocol_seq_clear(%s_seq* seq) {\n"
+          "  free(seq->items);\n"
+          "  seq->items = NULL;\n"
+          "  seq->count = seq->capacity = 0;\n"
+          "}\n"
+          "static void astrocol_seq_dtor(void* seq) {\n"
+          "  astrocol_seq_clear(seq);\n"
+          "}\n"
+          "%s_seq* %s_seq_new_in(%s_CONTEXT_T* context) {\n"
+          "  return %s_dalloc_in(context, sizeof(%s_seq), astrocol_seq_dtor);\n"
+          "}\n"
+          "%s_seq* %s_seq_new(void) {\n"
+          "  return %s_seq_new_in(%s_context);\n"
+          "}\n"
+          "%s_seq* %s_seq_append_in(%s_CONTEXT_T* context, %s_seq* seq,\n"
+          "                         %s* item) {\n"
+          "  %s** items;\n"
+          "  if (!seq) seq = %s_seq_new_in(context);\n"
+          "  if (seq->count == seq->capacity) {\n",
+          protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name,
           protocol_name,
           protocol_name);
+  if (memory_budget)
+    xprintf(out,
+            "    astrocol_charge((%s_context_t*)context,\n"
+            "                    (seq->capacity? seq->capacity : 4) *"
+            " sizeof(*items));\n",
+            protocol_name);
+  xprintf(out,
+          "    items = realloc(seq->items, (seq->capacity? seq->capacity*2 : 4) *\n"
+          "                    sizeof(%s*));\n"
+          "    if (!items) {\n"
+          "      (*((%s_context_t*)context)->oom)();\n"
+          "      abort();\n"
+          "    }\n"
+          "    seq->items = items;\n"
+          "    seq->capacity = seq->capacity? seq->capacity*2 : 4;\n"
+          "  }\n"
+          "  seq->items[seq->count++] = item;\n"
+          "  return seq;\n"
+          "}\n"
+          "%s_seq* %s_seq_append(%s_seq* seq, %s* item) {\n"
+          "  return %s_seq_append_in(%s_context, seq, item);\n"
+          "}\n",
+          protocol_name,
+          protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name);
 }
 
 static void define_element_dtor(FILE* out, element* elt) {
@@ -646,48 +2227,403 @@ static void define_element_dtor(FILE* out, element* elt) {
           elt->name, elt->name, protocol_name);
 }
 
+static void define_element_intern_hash(FILE* out, element* elt) {
+  field* member;
+
+  /* Children are hashed by identity, since they are either interned
+   * themselves or distinct by definition.
+   */
+  xprintf(out,
+          "static size_t astrocol_%s_intern_hash(const %s_t* this) {\n"
+          "  size_t h = astrocol_hash_string(ASTROCOL_HASH_SEED, \"%s\");\n",
+          elt->name, elt->name, elt->name);
+  if (has_sequence(elt))
+    xprintf(out, "  unsigned i;\n");
+
+  for (member = elt->members; member; member = member->next) {
+    if (':' == member->name[0] || '_' == member->name[0]) continue;
+
+    if (is_protocol_instance(member->type))
+      xprintf(out, "  h = astrocol_hash_mix(h, (size_t)this->%s);\n",
+              member->name);
+    else if (is_protocol_sequence(member->type))
+      xprintf(out,
+              "  h = astrocol_hash_mix(h, this->%s.count);\n"
+              "  for (i = 0; i < this->%s.count; ++i)\n"
+              "    h = astrocol_hash_mix(h, (size_t)this->%s.items[i]);\n",
+              member->name, member->name, member->name);
+    else if (is_string(member->type))
+      xprintf(out, "  h = astrocol_hash_string(h, this->%s);\n",
+              member->name);
+    else if (is_slice(member->type))
+      xprintf(out, "  h = astrocol_hash_slice(h, this->%s);\n",
+              member->name);
+    else
+      xprintf(out,
+              "  h = astrocol_hash_bytes(h, &this->%s, sizeof(this->%s));\n",
+              member->name, member->name);
+  }
+
+  xprintf(out, "  return h;\n}\n");
+}
+
+static void define_element_intern_equals(FILE* out, element* elt) {
+  field* member;
+
+  xprintf(out,
+          "static int astrocol_%s_intern_equals(const void* vthis,\n"
+          "                                     const void* vthat) {\n"
+          "  const %s_t* this = vthis, * that = vthat;\n"
+          "  if (this->core.vtable != that->core.vtable) return 0;\n",
+          elt->name, elt->name);
+
+  for (member = elt->members; member; member = member->next) {
+    if (':' == member->name[0] || '_' == member->name[0]) continue;
+
+    if (is_protocol_instance(member->type))
+      xprintf(out, "  if (this->%s != that->%s) return 0;\n",
+              member->name, member->name);
+    else if (is_protocol_sequence(member->type))
+      xprintf(out,
+              "  if (this->%s.count != that->%s.count ||\n"
+              "      (this->%s.count &&\n"
+              "       memcmp(this->%s.items, that->%s.items,\n"
+              "              this->%s.count * sizeof(%s*))))\n"
+              "    return 0;\n",
+              member->name, member->name, member->name,
+              member->name, member->name, member->name, protocol_name);
+    else if (is_string(member->type))
+      xprintf(out,
+              "  if (!astrocol_string_equals(this->%s, that->%s)) return 0;\n",
+              member->name, member->name);
+    else if (is_slice(member->type))
+      xprintf(out,
+              "  if (!astrocol_slice_equals(this->%s, that->%s)) return 0;\n",
+              member->name, member->name);
+    else
+      xprintf(out,
+              "  if (memcmp(&this->%s, &that->%s, sizeof(this->%s)))"
+              " return 0;\n",
+              member->name, member->name, member->name);
+  }
+
+  xprintf(out, "  return 1;\n}\n");
+}
+
+/*
+  Writes the return of the existing interned node given by expr, which the
+  builders' contents are no longer needed for.
+ */
+static void write_intern_hit(FILE* out, element* elt, const char* expr) {
+  field* member;
+
+  for (member = elt->members; member; member = member->next)
+    if (is_protocol_sequence(member->type))
+      xprintf(out, "    if (%s) astrocol_seq_clear(%s);\n",
+              member->name, member->name);
+  xprintf(out,
+          "    ASTROCOL_UNLOCK(astrocol_context, interned);\n");
+  if (generate_recording)
+    xprintf(out,
+            "    if (astrocol_context->recorder && !astrocol_record_depth)\n"
+            "      astrocol_record(astrocol_context, (%s*)%s);\n",
+            protocol_name, expr);
+  xprintf(out,
+          "    return (%s*)%s;\n"
+          "  }\n",
+          protocol_name, expr);
+}
+
+static void write_intern_lookup(FILE* out, element* elt) {
+  field* member;
+
+  /* Build the would-be element on the stack so that hashing and comparison
+   * work the same way for candidates and for existing nodes.
+   */
+  xprintf(out,
+          "  memset(&astrocol_key, 0, sizeof(astrocol_key));\n"
+          "  astrocol_key.core.vtable = &%s_vtable;\n",
+          elt->name);
+  for (member = elt->members; member; member = member->next) {
+    if (':' == member->name[0] || '_' == member->name[0]) continue;
+
+    if (is_protocol_sequence(member->type))
+      xprintf(out, "  if (%s) astrocol_key.%s = *%s;\n",
+              member->name, member->name, member->name);
+    else
+      xprintf(out, "  astrocol_key.%s = %s;\n", member->name, member->name);
+  }
+
+  xprintf(out,
+          "  astrocol_h = astrocol_%s_intern_hash(&astrocol_key);\n"
+          "  ASTROCOL_LOCK(astrocol_context, interned);\n"
+          "  this = astrocol_table_find(&astrocol_context->interned, astrocol_h,\n"
+          "                             astrocol_%s_intern_equals,\n"
+          "                             &astrocol_key);\n"
+          "  if (this) {\n",
+          elt->name, elt->name);
+  write_intern_hit(out, elt, "this");
+  /* Allocation may call oom, which need not return, so the lock is not held
+   * across it.
+   */
+  xprintf(out,
+          "  ASTROCOL_UNLOCK(astrocol_context, interned);\n");
+}
+
+/*
+  Checks again for an equal node once the new one has been allocated, since
+  another thread may have made one in the meantime. The lock is then held
+  until the new node is inserted.
+ */
+static void write_intern_recheck(FILE* out, element* elt) {
+  xprintf(out,
+          "  ASTROCOL_LOCK(astrocol_context, interned);\n"
+          "  astrocol_twin = astrocol_table_find(&astrocol_context->interned,\n"
+          "                                      astrocol_h,\n"
+          "                                      astrocol_%s_intern_equals,\n"
+          "                                      &astrocol_key);\n"
+          "  if (astrocol_twin) {\n",
+          elt->name);
+  if (generate_statistics)
+    xprintf(out,
+            "    astrocol_count(astrocol_context, %u, astrocol_size, 0);\n",
+            element_index(elt));
+  xprintf(out,
+          "    if (astrocol_dtor != astrocol_region_item_dtor) free(this);\n");
+  write_intern_hit(out, elt, "astrocol_twin");
+}
+
+static void write_ctor_callsite_args(FILE* out, field* arg) {
+  /* Skip alignment-only and internal members, as with write_args() */
+  while (arg && (arg->name[0] == ':' || arg->name[0] == '_'))
+    arg = arg->next;
+
+  if (!arg) return;
+
+  write_ctor_callsite_args(out, arg->next);
+  xprintf(out, ", %s", arg->name);
+}
+
 static void define_element_ctor(FILE* out, element* elt) {
+  field* member;
+
   define_element_dtor(out, elt);
+  if (elt->is_interned) {
+    define_element_intern_hash(out, elt);
+    define_element_intern_equals(out, elt);
+  }
 
-  xprintf(out, "%s* %s(YYLTYPE astrocol_where",
-          protocol_name, elt->name);
+  xprintf(out, "%s* %s_in(%s_CONTEXT_T* astrocol_context_,\n"
+          "  YYLTYPE astrocol_where",
+          protocol_name, elt->name, protocol_name);
   write_args(out, elt->members, '_');
   xprintf(out, ") {\n");
 
-  xprintf(out, "  %s_t* this = astrocol_malloc(sizeof(%s_t));\n",
-          elt->name, elt->name);
+  xprintf(out,
+          "  %s_context_t* astrocol_context =\n"
+          "    (%s_context_t*)astrocol_context_;\n"
+          "  %s_t* this;\n"
+          "  size_t astrocol_size = sizeof(%s_t);\n"
+          "  void (*astrocol_dtor)(void*) = astrocol_%s_dtor;\n",
+          protocol_name, protocol_name, elt->name, elt->name, elt->name);
+  if (elt->is_interned)
+    xprintf(out,
+            "  %s_t astrocol_key;\n"
+            "  size_t astrocol_h;\n",
+            elt->name);
+  if (elt->is_interned && concurrent_context)
+    xprintf(out, "  void* astrocol_twin;\n");
+  if (has_sequence(elt))
+    xprintf(out,
+            "  %s** astrocol_items;\n"
+            "  unsigned astrocol_i;\n",
+            protocol_name);
+
+  if (elt->is_interned)
+    write_intern_lookup(out, elt);
+
+  /* The contents of each sequence are stored contiguously after the element
+   * itself, so the whole node is still a single allocation.
+   */
+  for (member = elt->members; member; member = member->next)
+    if (is_protocol_sequence(member->type))
+      xprintf(out,
+              "  if (%s) astrocol_size += %s->count * sizeof(%s*);\n",
+              member->name, member->name, protocol_name);
+
+  xprintf(out,
+          "  this = astrocol_alloc_item(astrocol_context, astrocol_size,"
+          " &astrocol_dtor);\n");
+  if (generate_statistics)
+    xprintf(out,
+            "  astrocol_count(astrocol_context, %u, astrocol_size, 1);\n",
+            element_index(elt));
+  if (site_sampling)
+    xprintf(out,
+            "  astrocol_sample_site(astrocol_context, %u,\n"
+            "                       (long)astrocol_where.first_line,"
+            " astrocol_size);\n",
+            element_index(elt));
+  if (has_sequence(elt))
+    xprintf(out,
+            "  astrocol_items = (%s**)(this + 1);\n",
+            protocol_name);
   xprintf(out,
           "  memset(this, 0, sizeof(*this));\n"
           "  this->core.vtable = &%s_vtable;\n"
           "  this->core.where = astrocol_where;\n"
-          "  this->core.dtor = astrocol_%s_dtor;\n",
-          elt->name, elt->name);
+          "  this->core.dtor = astrocol_dtor;\n",
+          elt->name);
+  if (elt->is_interned && concurrent_context)
+    write_intern_recheck(out, elt);
 
   write_element_member_initialisers(out, elt->members);
 
   /* Add to allocation chain */
   xprintf(out,
-          "  this->core.gc_next = %s_CONTEXT->last;\n"
-          "  %s_CONTEXT->last = (%s*)this;\n",
-          protocol_name,
-          protocol_name, protocol_name);
+          "  astrocol_push(astrocol_context, (%s*)this);\n",
+          protocol_name);
+  if (elt->is_interned)
+    xprintf(out,
+            "  if (astrocol_table_insert(astrocol_context,\n"
+            "                            &astrocol_context->interned,\n"
+            "                            astrocol_h, this)) {\n"
+            "    ASTROCOL_UNLOCK(astrocol_context, interned);\n"
+            "    (*astrocol_context->oom)();\n"
+            "    abort();\n"
+            "  }\n"
+            "  ASTROCOL_UNLOCK(astrocol_context, interned);\n");
+  if (generate_recording)
+    xprintf(out,
+            "  if (astrocol_context->recorder && !astrocol_record_depth)\n"
+            "    astrocol_record(astrocol_context, (%s*)this);\n",
+            protocol_name);
+  if (generate_tracing)
+    xprintf(out,
+            "  if (!astrocol_context->traced_node%s)\n"
+            "%s"
+            "    astrocol_trace(\"first node\", 'i', astrocol_context);\n"
+            "%s",
+            concurrent_context? " &&\n"
+            "      !__atomic_exchange_n(&astrocol_context->traced_node, 1,\n"
+            "                           __ATOMIC_RELAXED)" : "",
+            concurrent_context? "" : "  {\n"
+            "    astrocol_context->traced_node = 1;\n",
+            concurrent_context? "" : "  }\n");
 
   /* Call user ctor if exists */
-  xprintf(out,
-          "  if (this->core.vtable->ctor)\n"
-          "    ctor((%s*)this);\n",
-          protocol_name);
+  if (generate_recording)
+    xprintf(out,
+            "  if (this->core.vtable->ctor) {\n"
+            "    ++astrocol_record_depth;\n"
+            "    ctor((%s*)this);\n"
+            "    --astrocol_record_depth;\n"
+            "  }\n",
+            protocol_name);
+  else
+    xprintf(out,
+            "  if (this->core.vtable->ctor)\n"
+            "    ctor((%s*)this);\n",
+            protocol_name);
 
   xprintf(out, "  return (%s*)this;\n}\n", protocol_name);
+
+  xprintf(out, "%s* %s(YYLTYPE astrocol_where", protocol_name, elt->name);
+  write_args(out, elt->members, '_');
+  xprintf(out,
+          ") {\n"
+          "  return %s_in(%s_context, astrocol_where",
+          elt->name, protocol_name);
+  write_ctor_callsite_args(out, elt->members);
+  xprintf(out, ");\n}\n");
 }
 
 static void define_element_ctors(FILE* out) {
   on_each_elt(out, define_element_ctor);
 }
 
+static void define_profiled_vcall_body(FILE* out, method* meth) {
+  int has_result = !is_void(meth->return_type);
+
+  if (has_result && profile_timing)
+    xprintf(out, "  %s astrocol_result;\n", meth->return_type);
+  if (profile_timing)
+    xprintf(out,
+            "  unsigned long long astrocol_start;\n");
+  xprintf(out,
+          "  %s_dispatch_count_t* astrocol_prof =\n"
+          "    &%s_dispatch_profile[this->vtable->element][%u];\n"
+          "  ASTROCOL_PROFILE_ADD(astrocol_prof->calls, 1);\n",
+          protocol_name, protocol_name, method_index(meth));
+
+  if (!profile_timing) {
+    xprintf(out, "  %s(*this->vtable->%s)(this",
+            has_result? "return " : "", meth->name);
+    write_callsite_args(out, meth->fields);
+    xprintf(out, ");\n}\n");
+    return;
+  }
+
+  xprintf(out,
+          "  astrocol_start = ASTROCOL_TICKS();\n"
+          "  %s(*this->vtable->%s)(this",
+          has_result? "astrocol_result = " : "", meth->name);
+  write_callsite_args(out, meth->fields);
+  xprintf(out,
+          ");\n"
+          "  ASTROCOL_PROFILE_ADD(astrocol_prof->ticks,"
+          " ASTROCOL_TICKS() - astrocol_start);\n"
+          "%s"
+          "}\n",
+          has_result? "  return astrocol_result;\n" : "");
+}
+
+/*
+  When the profile shows one element dominating a method, the call through
+  that element's vtable is tested for first; since the vtable is constant,
+  the compiler can turn it into a direct (and inlinable) call.
+ */
+static void write_dispatch_hint(FILE* out, method* meth) {
+  element* elt = meth->dominant;
+
+  if (!elt) return;
+
+  xprintf(out,
+          "  if (ASTROCOL_LIKELY(this->vtable == &%s_vtable))\n"
+          "    %s(*%s_vtable.%s)(this",
+          elt->name,
+          is_void(meth->return_type)? "{ " : "return ",
+          elt->name, meth->name);
+  write_callsite_args(out, meth->fields);
+  xprintf(out, ");%s\n",
+          is_void(meth->return_type)? " return; }" : "");
+}
+
+static void declare_dominant_vtables(FILE* out) {
+  element* elt;
+  method* meth;
+
+  xprintf(out,
+          "#ifdef __GNUC__\n"
+          "#define ASTROCOL_LIKELY(x) __builtin_expect(!!(x), 1)\n"
+          "#else\n"
+          "#define ASTROCOL_LIKELY(x) (x)\n"
+          "#endif\n");
+  for (elt = elements; elt; elt = elt->next)
+    for (meth = methods; meth; meth = meth->next)
+      if (elt == meth->dominant) {
+        xprintf(out, "static const %s_vtable %s_vtable;\n",
+                protocol_name, elt->name);
+        break;
+      }
+}
+
 static void define_protocol_vcalls(FILE* out) {
   method* meth;
 
+  if (profile_filename && !profile_dispatch)
+    declare_dominant_vtables(out);
+
   for (meth = methods; meth; meth = meth->next) {
     if (meth->is_implicit)
       xprintf(out, "static ");
@@ -695,8 +2631,17 @@ static void define_protocol_vcalls(FILE* out) {
     xprintf(out, "%s %s(%s* this",
             meth->return_type, meth->name, protocol_name);
     write_args(out, meth->fields, 0);
-    xprintf(out, ") {\n  ");
+    xprintf(out, ") {\n");
 
+    if (profile_dispatch) {
+      define_profiled_vcall_body(out, meth);
+      continue;
+    }
+
+    if (profile_filename)
+      write_dispatch_hint(out, meth);
+
+    xprintf(out, "  ");
     if (!is_void(meth->return_type))
       xprintf(out, "return ");
 
@@ -713,33 +2658,2174 @@ static void define_protocol_context(FILE* out) {
           "}\n");
 
   xprintf(out,
-          "%s_CONTEXT_T* %s_context;\n",
+          "%s%s_CONTEXT_T* %s_context;\n",
+          thread_local_context? "ASTROCOL_THREAD_LOCAL " : "",
           protocol_name, protocol_name);
   xprintf(out,
           "%s_CONTEXT_T* %s_create_context(void) {\n"
-          "  %s_context_t* context = astrocol_malloc(sizeof(%s_CONTEXT_T));\n"
+          "  %s_context_t* context = malloc(sizeof(%s_CONTEXT_T));\n"
           "  if (!context) return NULL;\n"
           "  memset(context, 0, sizeof(%s_CONTEXT_T));\n"
           "  context->oom = astrocol_default_oom;\n"
+          "%s"
+          "%s"
+          "%s"
           "  return (%s_CONTEXT_T*)context;\n"
           "}\n",
           protocol_name, protocol_name,
           protocol_name, protocol_name,
 
           protocol_name,
-
+          context_adoption? "  context->refs = 1;\n" : "",
+          memory_budget? "  context->budget = (size_t)-1;\n" : "",
+          generate_tracing?
+          "  astrocol_trace(\"create_context\", 'i', context);\n" : "",
           protocol_name);
 
+  /* Transparent huge pages are 2MB on the common platforms; rounding up lets
+   * the whole region be backed by them.
+   */
   xprintf(out,
-          "void %s_destroy_context(%s_CONTEXT_T* context_) {\n"
+          "%s_CONTEXT_T* %s_create_context_sized(size_t bytes,"
+          " unsigned flags) {\n"
+          "  %s_CONTEXT_T* context_ = %s_create_context();\n"
           "  %s_context_t* context = (%s_context_t*)context_;\n"
-          "  %s* item, * next;\n"
-          "  for (item = context->last; item; item = next) {\n"
-          "    next = item->gc_next;\n"
-          "    (*item->dtor)(item);\n"
+          "  void* region = NULL;\n"
+          "  size_t huge = (size_t)2 << 20;\n"
+          "  if (!context || !bytes) return context_;\n"
+          "  if (flags & %s_CONTEXT_HUGE_PAGES)\n"
+          "    bytes = (bytes + huge - 1) / huge * huge;\n"
+          "#ifdef ASTROCOL_HAVE_MMAP\n"
+          "  region = mmap(NULL, bytes, PROT_READ | PROT_WRITE,\n"
+          "                MAP_PRIVATE | MAP_ANONYMOUS\n"
+          "#ifdef MAP_POPULATE\n"
+          "                | (flags & %s_CONTEXT_PREFAULT? MAP_POPULATE : 0)\n"
+          "#endif\n"
+          "                , -1, 0);\n"
+          "  if (MAP_FAILED == region) {\n"
+          "    region = NULL;\n"
+          "  } else {\n"
+          "    context->region_mapped = 1;\n"
+          "#ifdef MADV_HUGEPAGE\n"
+          "    if (flags & %s_CONTEXT_HUGE_PAGES)\n"
+          "      madvise(region, bytes, MADV_HUGEPAGE);\n"
+          "#endif\n"
+          "  }\n"
+          "#endif\n"
+          "  if (!region) region = malloc(bytes);\n"
+          "  if (region) {\n"
+          "    context->region = region;\n"
+          "    context->region_size = bytes;\n"
           "  }\n"
+          "  return context_;\n"
           "}\n",
           protocol_name, protocol_name,
           protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
           protocol_name);
+
+  /* With adoption, each context counts a reference for its owner and one
+   * for each adoption of a subtree from it. The owner's reference is given
+   * up by destroying the context, which then keeps only what was adopted
+   * until the last adopter lets go.
+   */
+  if (context_adoption)
+    xprintf(out,
+            "static unsigned astrocol_unref(%s_context_t* context) {\n"
+            "  return %s;\n"
+            "}\n"
+            "static void astrocol_teardown(%s_context_t* context) {\n"
+            "  %s* item, * next;\n"
+            "  free(context->adopted);\n",
+            protocol_name,
+            concurrent_context?
+            "__atomic_sub_fetch(&context->refs, 1, __ATOMIC_ACQ_REL)" :
+            "--context->refs",
+            protocol_name, protocol_name);
+  else
+    xprintf(out,
+            "void %s_destroy_context(%s_CONTEXT_T* context_) {\n"
+            "  %s_context_t* context = (%s_context_t*)context_;\n"
+            "  %s* item, * next;\n"
+            "%s",
+            protocol_name, protocol_name,
+            protocol_name, protocol_name,
+            protocol_name,
+            generate_tracing?
+            "  astrocol_trace(\"destroy_context\", 'i', context);\n" : "");
+
+  /* The tables are freed first; destructors which would otherwise remove
+   * their entries check for this, since there is no point when the whole
+   * context is going away.
+   */
+  xprintf(out,
+          "  free(context->strings.slots);\n"
+          "  context->strings.slots = NULL;\n");
+  if (uses_interning())
+    xprintf(out,
+            "  free(context->interned.slots);\n"
+            "  context->interned.slots = NULL;\n");
+  xprintf(out,
+          "  for (item = context->last; item; item = next) {\n"
+          "    next = item->gc_next;\n"
+          "    (*item->dtor)(item);\n"
+          "  }\n"
+          "  astrocol_free_context(context);\n"
+          "}\n");
+
+  if (context_adoption) {
+    xprintf(out,
+            "void %s_destroy_context(%s_CONTEXT_T* context_) {\n"
+            "  %s_context_t* context = (%s_context_t*)context_;\n"
+            "  %s** parents;\n"
+            "  size_t i, n = context->adopted_count;\n"
+            "%s"
+            "  if (%s > 1) {\n"
+            "    /* Adopted subtrees have their parents in other contexts */\n"
+            "    parents = astrocol_malloc(context, (n? n : 1) * sizeof(%s*));\n"
+            "    for (i = 0; i < n; ++i)\n"
+            "      parents[i] = context->adopted[i]->parent;\n"
+            "    %s_collect(context_, context->adopted, n);\n"
+            "    for (i = 0; i < n; ++i)\n"
+            "      context->adopted[i]->parent = parents[i];\n"
+            "    free(parents);\n"
+            "    free(context->strings.slots);\n"
+            "    context->strings.slots = NULL;\n",
+            protocol_name, protocol_name,
+            protocol_name, protocol_name,
+            protocol_name,
+            generate_tracing?
+            "  astrocol_trace(\"destroy_context\", 'i', context);\n" : "",
+            concurrent_context?
+            "__atomic_load_n(&context->refs, __ATOMIC_ACQUIRE)" :
+            "context->refs",
+            protocol_name,
+            protocol_name);
+    if (uses_interning())
+      xprintf(out,
+              "    free(context->interned.slots);\n"
+              "    context->interned.slots = NULL;\n");
+    xprintf(out,
+            "  }\n"
+            "  if (!astrocol_unref(context))\n"
+            "    astrocol_teardown(context);\n"
+            "}\n");
+  }
+}
+
+static int uses_sequences(void) {
+  element* elt;
+
+  for (elt = elements; elt; elt = elt->next)
+    if (has_sequence(elt))
+      return 1;
+
+  return 0;
+}
+
+static int has_children(element* elt) {
+  field* f;
+
+  for (f = elt->members; f; f = f->next)
+    if (is_protocol_instance(f->type) || is_protocol_sequence(f->type))
+      return 1;
+
+  return 0;
+}
+
+static int uses_child_fields(void) {
+  element* elt;
+
+  for (elt = elements; elt; elt = elt->next)
+    if (has_children(elt))
+      return 1;
+
+  return 0;
+}
+
+static void write_node_children_for_member(FILE* out, element* elt,
+                                           field* member) {
+  if (!member) return;
+
+  write_node_children_for_member(out, elt, member->next);
+
+  if (is_protocol_instance(member->type))
+    xprintf(out,
+            "    if (((%s_t*)node)->%s)\n"
+            "      (*f)(&((%s_t*)node)->%s, userdata);\n",
+            elt->name, member->name, elt->name, member->name);
+  else if (is_protocol_sequence(member->type))
+    xprintf(out,
+            "    for (i = 0; i < ((%s_t*)node)->%s.count; ++i)\n"
+            "      if (((%s_t*)node)->%s.items[i])\n"
+            "        (*f)(((%s_t*)node)->%s.items + i, userdata);\n",
+            elt->name, member->name,
+            elt->name, member->name,
+            elt->name, member->name);
+}
+
+/*
+  Defines the element-independent machinery used to deal with nodes
+  generically: sizes, child iteration, and blocks of nodes sharing a single
+  allocation.
+ */
+static void define_node_funs(FILE* out) {
+  element* elt;
+  field* member;
+
+  xprintf(out, "static const size_t astrocol_element_sizes[] = {\n");
+  for (elt = elements; elt; elt = elt->next)
+    xprintf(out, "  sizeof(%s_t),\n", elt->name);
+  xprintf(out, "};\n");
+
+  /* Sequences live after the element proper, so must be counted too */
+  xprintf(out,
+          "static size_t astrocol_node_size(%s* node) {\n"
+          "  size_t size = astrocol_element_sizes[node->vtable->element];\n",
+          protocol_name);
+  if (uses_sequences()) {
+    xprintf(out, "  switch (node->vtable->element) {\n");
+    for (elt = elements; elt; elt = elt->next) {
+      if (!has_sequence(elt)) continue;
+      xprintf(out, "  case %u:\n", element_index(elt));
+      for (member = elt->members; member; member = member->next)
+        if (is_protocol_sequence(member->type))
+          xprintf(out,
+                  "    size += ((%s_t*)node)->%s.count * sizeof(%s*);\n",
+                  elt->name, member->name, protocol_name);
+      xprintf(out, "    break;\n");
+    }
+    xprintf(out, "  }\n");
+  }
+  xprintf(out, "  return size;\n}\n");
+
+  /* Calls f on each non-NULL child of node, in field order */
+  xprintf(out,
+          "static void astrocol_children(%s* node,\n"
+          "                              void (*f)(%s**, void*),\n"
+          "                              void* userdata) {\n",
+          protocol_name, protocol_name);
+  if (uses_sequences())
+    xprintf(out, "  unsigned i;\n");
+  xprintf(out, "  switch (node->vtable->element) {\n");
+  for (elt = elements; elt; elt = elt->next) {
+    if (!has_children(elt)) continue;
+    xprintf(out, "  case %u:\n", element_index(elt));
+    write_node_children_for_member(out, elt, elt->members);
+    xprintf(out, "    break;\n");
+  }
+  xprintf(out, "  }\n}\n");
+
+  if (uses_interning()) {
+    xprintf(out,
+            "static void astrocol_intern_node(%s_context_t* context,\n"
+            "                                 %s* node) {\n"
+            "  switch (node->vtable->element) {\n",
+            protocol_name, protocol_name);
+    for (elt = elements; elt; elt = elt->next)
+      if (elt->is_interned)
+        xprintf(out,
+                "  case %u:\n"
+                "    ASTROCOL_LOCK(context, interned);\n"
+                "    if (astrocol_table_insert(context, &context->interned,\n"
+                "          astrocol_%s_intern_hash((%s_t*)node), node)) {\n"
+                "      ASTROCOL_UNLOCK(context, interned);\n"
+                "      (*context->oom)();\n"
+                "      abort();\n"
+                "    }\n"
+                "    ASTROCOL_UNLOCK(context, interned);\n"
+                "    break;\n",
+                element_index(elt), elt->name, elt->name);
+    xprintf(out, "  }\n}\n");
+    /* Unlike astrocol_intern_node, returns any equal node already in the
+     * context instead of adding another.
+     */
+    xprintf(out,
+            "static %s* astrocol_intern_copy(%s_context_t* context,\n"
+            "                                %s* node) {\n"
+            "  void* twin = NULL;\n"
+            "  size_t h = 0;\n"
+            "  ASTROCOL_LOCK(context, interned);\n"
+            "  switch (node->vtable->element) {\n",
+            protocol_name, protocol_name, protocol_name);
+    for (elt = elements; elt; elt = elt->next)
+      if (elt->is_interned)
+        xprintf(out,
+                "  case %u:\n"
+                "    h = astrocol_%s_intern_hash((%s_t*)node);\n"
+                "    twin = astrocol_table_find(&context->interned, h,\n"
+                "                               astrocol_%s_intern_equals,"
+                " node);\n"
+                "    break;\n",
+                element_index(elt), elt->name, elt->name, elt->name);
+    xprintf(out,
+            "  }\n"
+            "  if (!twin &&\n"
+            "      astrocol_table_insert(context, &context->interned, h, node))"
+            " {\n"
+            "    ASTROCOL_UNLOCK(context, interned);\n"
+            "    (*context->oom)();\n"
+            "    abort();\n"
+            "  }\n"
+            "  ASTROCOL_UNLOCK(context, interned);\n"
+            "  return twin? (%s*)twin : node;\n"
+            "}\n",
+            protocol_name);
+    xprintf(out,
+            "static void astrocol_unintern_node(%s_context_t* context,\n"
+            "                                   %s* node) {\n"
+            "  switch (node->vtable->element) {\n",
+            protocol_name, protocol_name);
+    for (elt = elements; elt; elt = elt->next)
+      if (elt->is_interned)
+        xprintf(out,
+                "  case %u:\n"
+                "    astrocol_table_remove(&context->interned,\n"
+                "      astrocol_%s_intern_hash((%s_t*)node), node);\n"
+                "    break;\n",
+                element_index(elt), elt->name, elt->name);
+    xprintf(out, "  }\n}\n");
+  }
+
+  /* A node block holds a number of nodes laid out one after another,
+   * followed by arbitrary payload. The nodes are not on the allocation chain
+   * themselves; instead, the block's destructor runs theirs. Copies discarded
+   * in favour of an equal interned node were never constructed, and are
+   * marked by pointing their dtor at this function.
+   */
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s_context_t* context;\n"
+          "  size_t count;\n"
+          "} astrocol_node_block;\n"
+          "#define ASTROCOL_BLOCK_NODES(block) \\\n"
+          "  ((char*)(block) + ASTROCOL_ROUND(sizeof(astrocol_node_block)))\n",
+          protocol_name);
+  if (generate_statistics)
+    xprintf(out,
+            "static void astrocol_count_block(astrocol_node_block* block,"
+            " int alloc) {\n"
+            "  %s_context_t* context = astrocol_owner(block->context);\n"
+            "  char* node = ASTROCOL_BLOCK_NODES(block);\n"
+            "  size_t i, size;\n"
+            "  for (i = 0; i < block->count; ++i) {\n"
+            "    size = astrocol_node_size((%s*)node);\n"
+            "    astrocol_count(context, ((%s*)node)->vtable->element, size,"
+            " alloc);\n"
+            "    node += ASTROCOL_ROUND(size);\n"
+            "  }\n"
+            "}\n",
+            protocol_name, protocol_name, protocol_name);
+  xprintf(out,
+          "static void astrocol_node_block_dtor(void* vblock) {\n"
+          "  astrocol_node_block* block = vblock;\n"
+          "  char* node = ASTROCOL_BLOCK_NODES(block);\n"
+          "  size_t i;\n"
+          "%s"
+          "  for (i = 0; i < block->count; ++i) {\n",
+          generate_statistics? "  astrocol_count_block(block, 0);\n" : "");
+  /* Only needed when the block is destroyed before the context */
+  if (uses_interning())
+    xprintf(out,
+            "    if (astrocol_owner(block->context)->interned.slots &&\n"
+            "        ((%s*)node)->vtable->interned)\n"
+            "      astrocol_unintern_node(astrocol_owner(block->context),\n"
+            "                             (%s*)node);\n",
+            protocol_name, protocol_name);
+  xprintf(out,
+          "    if (((%s*)node)->vtable->dtor &&\n"
+          "        ((%s*)node)->dtor != astrocol_node_block_dtor)\n"
+          "      dtor((%s*)node);\n"
+          "    node += ASTROCOL_ROUND(astrocol_node_size((%s*)node));\n"
+          "  }\n"
+          "}\n"
+          "static astrocol_node_block* astrocol_node_block_new(\n"
+          "  %s_context_t* context, size_t size\n"
+          ") {\n"
+          "  astrocol_node_block* block = astrocol_dalloc(\n"
+          "    context, ASTROCOL_ROUND(sizeof(astrocol_node_block)) + size,\n"
+          "    astrocol_node_block_dtor);\n"
+          "  block->context = context;\n"
+          "  block->count = 0;\n"
+          "  return block;\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name);
+
+  /* Growable arrays of nodes, used as stacks and work lists */
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s** items;\n"
+          "  size_t count, capacity;\n"
+          "  int error;\n"
+          "} astrocol_node_list;\n"
+          "static void astrocol_node_list_push(astrocol_node_list* list,\n"
+          "                                    %s* node) {\n"
+          "  %s** items;\n"
+          "  if (list->error) return;\n"
+          "  if (list->count == list->capacity) {\n"
+          "    items = realloc(list->items, (list->capacity? list->capacity*2 :"
+          " 64) *\n"
+          "                    sizeof(%s*));\n"
+          "    if (!items) {\n"
+          "      list->error = 1;\n"
+          "      return;\n"
+          "    }\n"
+          "    list->items = items;\n"
+          "    list->capacity = list->capacity? list->capacity*2 : 64;\n"
+          "  }\n"
+          "  list->items[list->count++] = node;\n"
+          "}\n"
+          "static void astrocol_node_list_push_child(%s** child, void* list) {\n"
+          "  astrocol_node_list_push(list, *child);\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name);
+
+  /* Maps from node addresses to arbitrary values */
+  xprintf(out,
+          "typedef struct {\n"
+          "  const void* key;\n"
+          "  size_t value;\n"
+          "} astrocol_ptrmap_slot;\n"
+          "typedef struct {\n"
+          "  size_t count, mask;\n"
+          "  astrocol_ptrmap_slot* slots;\n"
+          "} astrocol_ptrmap;\n"
+          "static size_t astrocol_ptrmap_hash(const void* key) {\n"
+          "  size_t h = (size_t)key / sizeof(void*);\n"
+          "  return h ^ (h >> 9) ^ (h >> 17);\n"
+          "}\n"
+          "static size_t* astrocol_ptrmap_find(astrocol_ptrmap* map,\n"
+          "                                    const void* key) {\n"
+          "  size_t ix;\n"
+          "  if (!map->slots) return NULL;\n"
+          "  for (ix = astrocol_ptrmap_hash(key) & map->mask; map->slots[ix].key;\n"
+          "       ix = (ix+1) & map->mask)\n"
+          "    if (key == map->slots[ix].key)\n"
+          "      return &map->slots[ix].value;\n"
+          "  return NULL;\n"
+          "}\n"
+          "static int astrocol_ptrmap_put(astrocol_ptrmap* map, const void* key,\n"
+          "                               size_t value) {\n"
+          "  astrocol_ptrmap_slot* slots, * old = map->slots;\n"
+          "  size_t ix, i, size;\n"
+          "  if (!map->slots || map->count*2 >= map->mask) {\n"
+          "    size = map->slots? (map->mask+1)*2 : 64;\n"
+          "    slots = calloc(size, sizeof(astrocol_ptrmap_slot));\n"
+          "    if (!slots) return -1;\n"
+          "    map->slots = slots;\n"
+          "    map->mask = size-1;\n"
+          "    map->count = 0;\n"
+          "    for (i = 0; old && i < size/2; ++i)\n"
+          "      if (old[i].key)\n"
+          "        astrocol_ptrmap_put(map, old[i].key, old[i].value);\n"
+          "    free(old);\n"
+          "  }\n"
+          "  for (ix = astrocol_ptrmap_hash(key) & map->mask; map->slots[ix].key;\n"
+          "       ix = (ix+1) & map->mask);\n"
+          "  map->slots[ix].key = key;\n"
+          "  map->slots[ix].value = value;\n"
+          "  ++map->count;\n"
+          "  return 0;\n"
+          "}\n");
+
+  /* Nodes are numbered in preorder; nodes reachable by more than one path
+   * (ie, interned nodes) are only numbered once.
+   */
+  xprintf(out,
+          "static int astrocol_number_nodes(%s* root, astrocol_node_list* order,\n"
+          "                                 astrocol_ptrmap* indices,\n"
+          "                                 int materialise) {\n"
+          "  astrocol_node_list stack, children;\n"
+          "  %s* node;\n"
+          "  size_t i;\n"
+          "  int error = 0;\n"
+          "  memset(&stack, 0, sizeof(stack));\n"
+          "  memset(&children, 0, sizeof(children));\n"
+          "  astrocol_node_list_push(&stack, root);\n"
+          "  while (stack.count && !error) {\n"
+          "    node = stack.items[--stack.count];\n"
+          "    if (astrocol_ptrmap_find(indices, node)) continue;\n",
+          protocol_name, protocol_name);
+  /* Lazily loaded nodes have no children until decoded */
+  if (generate_snapshots)
+    xprintf(out,
+            "    if (materialise)\n"
+            "      %s_materialise(node);\n",
+            protocol_name);
+  else
+    xprintf(out, "    (void)materialise;\n");
+  xprintf(out,
+          "    if (astrocol_ptrmap_put(indices, node, order->count)) error = 1;\n"
+          "    astrocol_node_list_push(order, node);\n"
+          "    children.count = 0;\n"
+          "    astrocol_children(node, astrocol_node_list_push_child, &children);\n"
+          "    for (i = children.count; i; --i)\n"
+          "      if (!astrocol_ptrmap_find(indices, children.items[i-1]))\n"
+          "        astrocol_node_list_push(&stack, children.items[i-1]);\n"
+          "    error |= stack.error | children.error | order->error;\n"
+          "  }\n"
+          "  free(stack.items);\n"
+          "  free(children.items);\n"
+          "  return error;\n"
+          "}\n");
+}
+
+static void write_clone_payload_for_member(FILE* out, field* member) {
+  if (!member) return;
+
+  write_clone_payload_for_member(out, member->next);
+
+  if ('_' == member->name[0]) return;
+
+  if (is_string(member->type))
+    xprintf(out,
+            "    if (this->%s) size += strlen(this->%s) + 1;\n",
+            member->name, member->name);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "    if (this->%s.str) size += this->%s.len + 1;\n",
+            member->name, member->name);
+}
+
+static void write_clone_fixup_for_member(FILE* out, field* member) {
+  if (!member) return;
+
+  write_clone_fixup_for_member(out, member->next);
+
+  if (':' == member->name[0]) return;
+
+  if ('_' == member->name[0])
+    xprintf(out,
+            "    memset(&this->%s, 0, sizeof(this->%s));\n",
+            member->name, member->name);
+  else if (is_protocol_sequence(member->type))
+    /* Copy from the original's items, since the constructor and the snapshot
+     * loader do not lay out multiple sequences in the same order.
+     */
+    xprintf(out,
+            "    memcpy(items, this->%s.items,\n"
+            "           this->%s.count * sizeof(*items));\n"
+            "    this->%s.items = items;\n"
+            "    this->%s.capacity = this->%s.count;\n"
+            "    items += this->%s.count;\n",
+            member->name, member->name,
+            member->name, member->name, member->name, member->name);
+  else if (is_string(member->type))
+    xprintf(out,
+            "    if (this->%s) {\n"
+            "      n = strlen(this->%s) + 1;\n"
+            "      memcpy(*payload, this->%s, n);\n"
+            "      this->%s = (%s)*payload;\n"
+            "      *payload += n;\n"
+            "    }\n",
+            member->name, member->name, member->name,
+            member->name, member->type);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "    if (this->%s.str) {\n"
+            "      memcpy(*payload, this->%s.str, this->%s.len);\n"
+            "      (*payload)[this->%s.len] = 0;\n"
+            "      this->%s.str = *payload;\n"
+            "      *payload += this->%s.len + 1;\n"
+            "    }\n",
+            member->name, member->name, member->name, member->name,
+            member->name, member->name);
+}
+
+/*
+  Copies a tree into a single node block, in preorder, so that later passes
+  over it walk memory sequentially.
+ */
+static void define_clone_funs(FILE* out) {
+  element* elt;
+  int strings = uses_strings() || uses_slices();
+
+  if (strings) {
+    xprintf(out,
+            "static size_t astrocol_clone_payload(%s* node) {\n"
+            "  size_t size = 0;\n"
+            "  switch (node->vtable->element) {\n",
+            protocol_name);
+    for (elt = elements; elt; elt = elt->next) {
+      xprintf(out,
+              "  case %u: {\n"
+              "    %s_t* this = (%s_t*)node;\n"
+              "    (void)this;\n",
+              element_index(elt), elt->name, elt->name);
+      write_clone_payload_for_member(out, elt->members);
+      xprintf(out, "  } break;\n");
+    }
+    xprintf(out,
+            "  }\n"
+            "  return size;\n"
+            "}\n");
+  }
+
+  /* Gives the copy its own sequence storage and strings, and resets
+   * internal fields, since those belong to the original.
+   */
+  xprintf(out,
+          "static void astrocol_clone_fixup(%s* node, char** payload) {\n"
+          "  %s** items = (%s**)((char*)node +\n"
+          "    astrocol_element_sizes[node->vtable->element]);\n"
+          "  size_t n;\n"
+          "  (void)items; (void)n; (void)payload;\n"
+          "  node->gc_next = NULL;\n"
+          "  node->dtor = NULL;\n"
+          "  node->parent = NULL;\n"
+          "  switch (node->vtable->element) {\n",
+          protocol_name, protocol_name, protocol_name);
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out,
+            "  case %u: {\n"
+            "    %s_t* this = (%s_t*)node;\n"
+            "    (void)this;\n",
+            element_index(elt), elt->name, elt->name);
+    write_clone_fixup_for_member(out, elt->members);
+    xprintf(out, "  } break;\n");
+  }
+  xprintf(out, "  }\n}\n");
+
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s* node;\n"
+          "  astrocol_ptrmap* indices;\n"
+          "  %s** copies;\n"
+          "} astrocol_clone_relink;\n"
+          "static void astrocol_clone_relink_child(%s** child, void* vr) {\n"
+          "  astrocol_clone_relink* r = vr;\n"
+          "  *child = r->copies[*astrocol_ptrmap_find(r->indices, *child)];\n",
+          protocol_name, protocol_name, protocol_name);
+  /* Interned nodes are shared, so do not belong to any one parent */
+  if (uses_interning())
+    xprintf(out,
+            "  if (!(*child)->vtable->interned)\n"
+            "    (*child)->parent = r->node;\n");
+  else
+    xprintf(out,
+            "  (*child)->parent = r->node;\n");
+  xprintf(out, "}\n");
+
+  xprintf(out,
+          "%s* %s_clone_into(%s_CONTEXT_T* context_, %s* root) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  astrocol_node_list order;\n"
+          "  astrocol_ptrmap indices;\n"
+          "  astrocol_clone_relink relink;\n"
+          "  astrocol_node_block* block;\n"
+          "  %s** copies;\n"
+          "  char* mem, * payload;\n"
+          "  size_t i, size = 0, payload_size = 0;\n"
+          "  if (!root) return NULL;\n"
+          "  memset(&order, 0, sizeof(order));\n"
+          "  memset(&indices, 0, sizeof(indices));\n"
+          "  if (astrocol_number_nodes(root, &order, &indices, 1)) {\n"
+          "    free(order.items);\n"
+          "    free(indices.slots);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  for (i = 0; i < order.count; ++i) {\n"
+          "    size += ASTROCOL_ROUND(astrocol_node_size(order.items[i]));\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name);
+  if (strings)
+    xprintf(out,
+            "    payload_size += astrocol_clone_payload(order.items[i]);\n");
+  xprintf(out,
+          "  }\n"
+          "  copies = astrocol_malloc(context, order.count * sizeof(%s*));\n"
+          "  block = astrocol_node_block_new(context, size + payload_size);\n"
+          "  mem = ASTROCOL_BLOCK_NODES(block);\n"
+          "  payload = mem + size;\n"
+          "  for (i = 0; i < order.count; ++i) {\n"
+          "    copies[i] = (%s*)mem;\n"
+          "    memcpy(mem, order.items[i], astrocol_node_size(order.items[i]));\n"
+          "    mem += ASTROCOL_ROUND(astrocol_node_size(order.items[i]));\n"
+          "    astrocol_clone_fixup(copies[i], &payload);\n"
+          "  }\n"
+          "  relink.indices = &indices;\n"
+          "  relink.copies = copies;\n",
+          protocol_name, protocol_name);
+  /* Children follow their parents in preorder, so relinking backwards sees
+   * each child's final node, and interned copies can be looked up in the
+   * destination by their children's identity. A copy replaced by an equal
+   * node already there is marked, and its entry in order cleared.
+   */
+  xprintf(out,
+          "  for (i = order.count; i; --i) {\n"
+          "    relink.node = copies[i-1];\n"
+          "    astrocol_children(copies[i-1], astrocol_clone_relink_child,"
+          " &relink);\n");
+  if (uses_interning())
+    xprintf(out,
+            "    if (copies[i-1]->vtable->interned) {\n"
+            "      root = astrocol_intern_copy(context, copies[i-1]);\n"
+            "      if (root != copies[i-1]) {\n"
+            "        copies[i-1]->dtor = astrocol_node_block_dtor;\n"
+            "        copies[i-1] = root;\n"
+            "        order.items[i-1] = NULL;\n"
+            "      }\n"
+            "    }\n");
+  /* Construction order is children before parents, as with constructors */
+  xprintf(out,
+          "  }\n"
+          "  block->count = order.count;\n"
+          "%s"
+          "  for (i = order.count; i; --i)\n"
+          "    if (order.items[i-1] && copies[i-1]->vtable->ctor)\n"
+          "      ctor(copies[i-1]);\n"
+          "  root = copies[0];\n"
+          "  free(copies);\n"
+          "  free(order.items);\n"
+          "  free(indices.slots);\n"
+          "  return root;\n"
+          "}\n",
+          generate_statistics? "  astrocol_count_block(block, 1);\n" : "");
+}
+
+/*
+  Destroys a single item on the allocation chain, which must already have
+  been unlinked, without disturbing the rest of the context.
+ */
+static void define_release_funs(FILE* out) {
+  xprintf(out,
+          "static void astrocol_orphan_child(%s** child, void* parent) {\n"
+          "  if ((*child)->parent == parent)\n"
+          "    (*child)->parent = NULL;\n"
+          "}\n"
+          "static void astrocol_destroy_item(%s_context_t* context, %s* item)"
+          " {\n"
+          "  (void)context;\n"
+          "  /* Memory allocated by dalloc has no vtable */\n"
+          "  if (item->vtable) {\n",
+          protocol_name, protocol_name, protocol_name);
+  if (uses_interning())
+    xprintf(out,
+            "    if (item->vtable->interned)\n"
+            "      astrocol_unintern_node(context, item);\n");
+  xprintf(out,
+          "    astrocol_children(item, astrocol_orphan_child, item);\n"
+          "  }\n");
+  if (generate_statistics)
+    xprintf(out,
+            "  if (item->vtable)\n"
+            "    astrocol_count(context, item->vtable->element,\n"
+            "                   astrocol_node_size(item), 0);\n"
+            "  else\n"
+            "    astrocol_count(context, ASTROCOL_STATS_MEMORY,\n"
+            "                   ((astrocol_memory*)item)->size, 0);\n");
+  xprintf(out,
+          "  (*item->dtor)(item);\n"
+          "}\n");
+
+  xprintf(out,
+          "%s_mark_t %s_mark(void) {\n"
+          "  %s_mark_t mark;\n"
+          "  mark.last = %s_CONTEXT->last;\n"
+          "  mark.generation = %s_CONTEXT->generation;\n"
+          "  return mark;\n"
+          "}\n"
+          "int %s_release_to(%s_mark_t mark) {\n"
+          "  %s_context_t* context = %s_CONTEXT;\n"
+          "  %s* item;\n"
+          "  /* The marked item may since have been unlinked */\n"
+          "  if (mark.generation != context->generation) return -1;\n"
+          "  while (context->last != mark.last) {\n"
+          "    assert(context->last);\n"
+          "    item = context->last;\n"
+          "    context->last = item->gc_next;\n"
+          "    if (item == context->first) context->first = NULL;\n"
+          "    astrocol_destroy_item(context, item);\n"
+          "  }\n"
+          "  return 0;\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name);
+
+  /* Node blocks are destroyed as a whole, so are kept if any node within
+   * them survives. Other memory is always kept, since it may be referenced
+   * by surviving nodes in ways astrocol cannot see.
+   */
+  xprintf(out,
+          "static int astrocol_block_live(astrocol_node_block* block,\n"
+          "                               astrocol_ptrmap* live) {\n"
+          "  char* node = ASTROCOL_BLOCK_NODES(block);\n"
+          "  size_t i;\n"
+          "  for (i = 0; i < block->count; ++i) {\n"
+          "    if (astrocol_ptrmap_find(live, node)) return 1;\n"
+          "    node += ASTROCOL_ROUND(astrocol_node_size((%s*)node));\n"
+          "  }\n"
+          "  return 0;\n"
+          "}\n"
+          "static int astrocol_item_live(%s* item, astrocol_ptrmap* live) {\n"
+          "  astrocol_memory* mem = (astrocol_memory*)item;\n"
+          "  if (item->vtable)\n"
+          "    return !!astrocol_ptrmap_find(live, item);\n"
+          "  if (astrocol_node_block_dtor == mem->dtor)\n"
+          "    return !((astrocol_node_block*)mem->data)->count ||\n"
+          "           astrocol_block_live((astrocol_node_block*)mem->data,"
+          " live);\n"
+          "  return 1;\n"
+          "}\n",
+          protocol_name, protocol_name);
+
+  /* Only children the subtree owns (ie, whose parent is within it) are
+   * destroyed, so shared interned nodes survive. Nodes within node blocks
+   * (which have no destructor of their own) can only be freed with their
+   * block, so are left alone.
+   */
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s* parent;\n"
+          "  astrocol_node_list* stack;\n"
+          "} astrocol_owned_children;\n"
+          "static void astrocol_push_owned_child(%s** child, void* vowned) {\n"
+          "  astrocol_owned_children* owned = vowned;\n"
+          "  if ((*child)->parent == owned->parent && (*child)->dtor)\n"
+          "    astrocol_node_list_push(owned->stack, *child);\n"
+          "}\n"
+          "void %s_destroy_subtree(%s* root) {\n"
+          "  %s_context_t* context = %s_CONTEXT;\n"
+          "  astrocol_node_list stack;\n"
+          "  astrocol_ptrmap targets;\n"
+          "  astrocol_owned_children owned;\n"
+          "  %s** prev, * item, * kept = NULL;\n"
+          "  size_t remaining = 0;\n"
+          "  int error = 0;\n"
+          "  if (!root || !root->dtor) return;\n"
+          "  memset(&stack, 0, sizeof(stack));\n"
+          "  memset(&targets, 0, sizeof(targets));\n"
+          "  owned.stack = &stack;\n"
+          "  astrocol_node_list_push(&stack, root);\n"
+          "  while (stack.count && !error) {\n"
+          "    owned.parent = stack.items[--stack.count];\n"
+          "    if (astrocol_ptrmap_find(&targets, owned.parent)) continue;\n"
+          "    error = astrocol_ptrmap_put(&targets, owned.parent, 0);\n"
+          "    ++remaining;\n"
+          "    astrocol_children(owned.parent, astrocol_push_owned_child,"
+          " &owned);\n"
+          "    error |= stack.error;\n"
+          "  }\n"
+          "  free(stack.items);\n"
+          "  if (error) {\n"
+          "    free(targets.slots);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  /* Children are always older than their parents, so this destroys\n"
+          "   * parents first, as destroying the context would. */\n"
+          "  prev = &context->last;\n"
+          "  while (remaining && (item = *prev)) {\n"
+          "    if (item->vtable && astrocol_ptrmap_find(&targets, item)) {\n"
+          "      *prev = item->gc_next;\n"
+          "      if (item == context->first) context->first = kept;\n"
+          "      astrocol_destroy_item(context, item);\n"
+          "      ++context->generation;\n"
+          "      --remaining;\n"
+          "    } else {\n"
+          "      prev = &item->gc_next;\n"
+          "      kept = item;\n"
+          "    }\n"
+          "  }\n"
+          "  free(targets.slots);\n"
+          "}\n",
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name);
+
+  xprintf(out,
+          "void %s_collect(%s_CONTEXT_T* context_, %s** roots, size_t n) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  astrocol_node_list live;\n"
+          "  astrocol_ptrmap marks;\n"
+          "  %s** prev, * item, * kept = NULL;\n"
+          "  size_t i;\n"
+          "  int error = 0;\n"
+          "  memset(&live, 0, sizeof(live));\n"
+          "  memset(&marks, 0, sizeof(marks));\n"
+          "  for (i = 0; i < n && !error; ++i)\n"
+          "    if (roots[i])\n"
+          "      error = astrocol_number_nodes(roots[i], &live, &marks, 0);\n"
+          "  if (error) {\n"
+          "    free(live.items);\n"
+          "    free(marks.slots);\n"
+          "    (*context->oom)();\n"
+          "    abort();\n"
+          "  }\n"
+          "  /* Survivors must not point to destroyed parents */\n"
+          "  for (i = 0; i < live.count; ++i)\n"
+          "    if (live.items[i]->parent &&\n"
+          "        !astrocol_ptrmap_find(&marks, live.items[i]->parent))\n"
+          "      live.items[i]->parent = NULL;\n"
+          "  prev = &context->last;\n"
+          "  while ((item = *prev)) {\n"
+          "    if (astrocol_item_live(item, &marks)) {\n"
+          "      prev = &item->gc_next;\n"
+          "      kept = item;\n"
+          "    } else {\n"
+          "      *prev = item->gc_next;\n"
+          "      if (item == context->first) context->first = kept;\n"
+          "      astrocol_destroy_item(context, item);\n"
+          "      ++context->generation;\n"
+          "    }\n"
+          "  }\n"
+          "  free(live.items);\n"
+          "  free(marks.slots);\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name);
+
+  /* Memory keeps pointing at the context it was allocated in, so the merged
+   * context is only marked as such, and freed once everything allocated in
+   * it has been destroyed. Its record is therefore moved to the oldest end
+   * of its chain before splicing that in front of the destination's.
+   */
+  xprintf(out,
+          "static void astrocol_retired_context_dtor(void* vcontext) {\n"
+          "  astrocol_free_context(*(%s_context_t**)vcontext);\n"
+          "}\n"
+          "static void astrocol_table_merge(%s_context_t* context,\n"
+          "                                 %s_hash_table* dst,\n"
+          "                                 %s_hash_table* src) {\n"
+          "  size_t ix;\n"
+          "  if (!src->slots) return;\n"
+          "  for (ix = 0; ix <= src->mask; ++ix)\n"
+          "    if (src->slots[ix].value &&\n"
+          "        astrocol_table_insert(context, dst, src->slots[ix].hash,\n"
+          "                              src->slots[ix].value)) {\n"
+          "      (*context->oom)();\n"
+          "      abort();\n"
+          "    }\n"
+          "  free(src->slots);\n"
+          "  memset(src, 0, sizeof(*src));\n"
+          "}\n"
+          "void %s_merge_context(%s_CONTEXT_T* dst_, %s_CONTEXT_T* src_) {\n"
+          "  %s_context_t* dst = (%s_context_t*)dst_;\n"
+          "  %s_context_t* src = (%s_context_t*)src_;\n"
+          "  %s* record;\n"
+          "%s"
+          "%s"
+          "  assert(dst != src && !dst->merged && !src->merged);\n"
+          "%s"
+          "  *(%s_context_t**)astrocol_dalloc(\n"
+          "    src, sizeof(src), astrocol_retired_context_dtor) = src;\n"
+          "  record = src->last;\n"
+          "  if (record->gc_next) {\n"
+          "    src->last = record->gc_next;\n"
+          "    record->gc_next = NULL;\n"
+          "    src->first->gc_next = record;\n"
+          "    src->first = record;\n"
+          "  }\n"
+          "  astrocol_table_merge(dst, &dst->strings, &src->strings);\n",
+          protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          generate_statistics? "  size_t i;\n" : "",
+          site_sampling? "  size_t j;\n" : "",
+          context_adoption?
+          "  assert(src->refs == 1);\n"
+          "  free(src->adopted);\n"
+          "  src->adopted = NULL;\n"
+          "  src->adopted_count = src->adopted_size = 0;\n" : "",
+          protocol_name);
+  if (uses_interning())
+    xprintf(out,
+            "  astrocol_table_merge(dst, &dst->interned, &src->interned);\n");
+  if (memory_budget)
+    xprintf(out, "  dst->budget_used += src->budget_used;\n");
+  if (generate_tracing)
+    xprintf(out, "  astrocol_trace(\"merge_context\", 'i', dst);\n");
+  if (site_sampling)
+    xprintf(out,
+            "  for (j = 0; src->sites && j <= src->site_mask; ++j)\n"
+            "    if (src->sites[j].samples &&\n"
+            "        astrocol_site_add(dst, &src->sites[j])) {\n"
+            "      (*dst->oom)();\n"
+            "      abort();\n"
+            "    }\n"
+            "  free(src->sites);\n"
+            "  src->sites = NULL;\n");
+  if (generate_statistics)
+    xprintf(out,
+            "  for (i = 0; i < %s_STATS_COUNT; ++i) {\n"
+            "    dst->stats[i].live += src->stats[i].live;\n"
+            "    dst->stats[i].total += src->stats[i].total;\n"
+            "    dst->stats[i].bytes += src->stats[i].bytes;\n"
+            "  }\n",
+            protocol_name);
+  xprintf(out,
+          "  src->first->gc_next = dst->last;\n"
+          "  if (!dst->first) dst->first = src->first;\n"
+          "  dst->last = src->last;\n"
+          "  src->last = src->first = NULL;\n"
+          "  src->merged = dst;\n"
+          "  if (%s_context == src_) %s_context = dst_;\n"
+          "}\n",
+          protocol_name, protocol_name);
+
+  if (context_adoption)
+    define_adoption_funs(out);
+}
+
+static void define_adoption_funs(FILE* out) {
+  /* The record of the adoption lives in the adopting context, so the source
+   * is released when the adopter is destroyed or releases past it.
+   */
+  xprintf(out,
+          "static void astrocol_adoption_dtor(void* vsrc) {\n"
+          "  %s_context_t* src = *(%s_context_t**)vsrc;\n"
+          "  if (!astrocol_unref(src))\n"
+          "    astrocol_teardown(src);\n"
+          "}\n"
+          "%s* %s_adopt(%s_CONTEXT_T* dst_, %s_CONTEXT_T* src_,"
+          " %s* node) {\n"
+          "  %s_context_t* dst = (%s_context_t*)dst_;\n"
+          "  %s_context_t* src = (%s_context_t*)src_;\n"
+          "  %s** adopted;\n"
+          "  size_t size;\n"
+          "  if (!node) return NULL;\n"
+          "  ASTROCOL_LOCK(src, adopted);\n"
+          "  if (src->adopted_count == src->adopted_size) {\n"
+          "    size = src->adopted_size? src->adopted_size*2 : 8;\n"
+          "    adopted = realloc(src->adopted, size * sizeof(%s*));\n"
+          "    if (!adopted) {\n"
+          "      ASTROCOL_UNLOCK(src, adopted);\n"
+          "      (*dst->oom)();\n"
+          "      abort();\n"
+          "    }\n"
+          "    src->adopted = adopted;\n"
+          "    src->adopted_size = size;\n"
+          "  }\n"
+          "  src->adopted[src->adopted_count++] = node;\n"
+          "  ASTROCOL_UNLOCK(src, adopted);\n"
+          "  node->parent = NULL;\n"
+          "  %s;\n"
+          "  *(%s_context_t**)astrocol_dalloc(\n"
+          "    dst, sizeof(src), astrocol_adoption_dtor) = src;\n"
+          "  return node;\n"
+          "}\n",
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name, protocol_name,
+          protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          concurrent_context?
+          "__atomic_add_fetch(&src->refs, 1, __ATOMIC_RELAXED)" :
+          "++src->refs",
+          protocol_name);
+}
+
+/*
+  Computes a value identifying the layout of the protocol, so that snapshots
+  written by a different version of the protocol are rejected.
+ */
+static unsigned long snapshot_signature(void) {
+  unsigned long h = 2166136261ul;
+  element* elt;
+  field* f;
+  const char* str;
+
+#define MIX(s)                                                  \
+  for (str = (s); ; ++str) {                                    \
+    h = ((h ^ (unsigned char)*str) * 16777619ul) & 0xFFFFFFFFul; \
+    if (!*str) break;                                           \
+  }
+
+  MIX(protocol_name);
+  for (elt = elements; elt; elt = elt->next) {
+    MIX(elt->name);
+    for (f = elt->members; f; f = f->next) {
+      MIX(f->name);
+      MIX(f->type);
+    }
+  }
+
+#undef MIX
+
+  return h;
+}
+
+static void declare_snapshot_funs(FILE* out) {
+  xprintf(out,
+          "int %s_save(%s*, FILE*);\n"
+          "%s* %s_load(%s_CONTEXT_T*, const void*, size_t);\n"
+          "%s* %s_open(%s_CONTEXT_T*, const char*);\n"
+          "void %s_materialise(%s*);\n",
+          protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name);
+}
+
+static void declare_serializers(FILE* out) {
+  serializer* ser;
+
+  for (ser = serializers; ser; ser = ser->next)
+    xprintf(out,
+            "long %s_save(%s const*, FILE*);\n"
+            "int %s_load(%s*, const unsigned char**, const unsigned char*,\n"
+            "            %s_CONTEXT_T*);\n",
+            ser->prefix, ser->type,
+            ser->prefix, ser->type, protocol_name);
+}
+
+static void write_save_field(FILE* out, field* member) {
+  if (!member) return;
+
+  write_save_field(out, member->next);
+
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type))
+    xprintf(out,
+            "    astrocol_save_ref(w, this->%s, self, indices);\n",
+            member->name);
+  else if (is_protocol_sequence(member->type))
+    xprintf(out,
+            "    astrocol_write_u32(w, this->%s.count);\n"
+            "    *extra += this->%s.count;\n"
+            "    for (i = 0; i < this->%s.count; ++i)\n"
+            "      astrocol_save_ref(w, this->%s.items[i], self, indices);\n",
+            member->name, member->name, member->name, member->name);
+  else if (is_string(member->type))
+    xprintf(out,
+            "    astrocol_save_string(w, this->%s,\n"
+            "                         this->%s? strlen(this->%s) : 0,"
+            " payload);\n",
+            member->name, member->name, member->name);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "    astrocol_save_string(w, this->%s.str, this->%s.len,"
+            " payload);\n",
+            member->name, member->name);
+  else if (is_opaque(member->type))
+    xprintf(out,
+            "    if (!w->error) {\n"
+            "      n = %s_save(&this->%s, w->out);\n"
+            "      if (n < 0) w->error = 1;\n"
+            "      else w->offset += n;\n"
+            "    }\n",
+            find_serializer(member->type), member->name);
+  else
+    xprintf(out,
+            "    astrocol_write(w, &this->%s, sizeof(this->%s));\n",
+            member->name, member->name);
+}
+
+static void write_load_field(FILE* out, field* member) {
+  if (!member) return;
+
+  write_load_field(out, member->next);
+
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type))
+    xprintf(out,
+            "    this->%s = astrocol_load_ref(s, &r, self);\n",
+            member->name);
+  else if (is_protocol_sequence(member->type))
+    xprintf(out,
+            "    n = astrocol_read_u32(&r);\n"
+            "    if (n > extra) return -1;\n"
+            "    extra -= n;\n"
+            "    this->%s.count = this->%s.capacity = n;\n"
+            "    this->%s.items = items;\n"
+            "    for (i = 0; i < n; ++i)\n"
+            "      *items++ = astrocol_load_ref(s, &r, self);\n",
+            member->name, member->name, member->name);
+  else if (is_string(member->type))
+    xprintf(out,
+            "    this->%s = (%s)astrocol_load_string(s, &r, NULL);\n",
+            member->name, member->type);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "    this->%s.str = astrocol_load_string(s, &r, &this->%s.len);\n",
+            member->name, member->name);
+  else if (is_opaque(member->type))
+    xprintf(out,
+            "    if (!r.error &&\n"
+            "        %s_load(&this->%s, &r.p, r.end,\n"
+            "                (%s_CONTEXT_T*)s->context))\n"
+            "      return -1;\n",
+            find_serializer(member->type), member->name, protocol_name);
+  else
+    xprintf(out,
+            "    astrocol_read_bytes(&r, &this->%s, sizeof(this->%s));\n",
+            member->name, member->name);
+}
+
+static void define_snapshot_writer(FILE* out) {
+  element* elt;
+
+  xprintf(out,
+          "typedef struct {\n"
+          "  FILE* out;\n"
+          "  size_t offset;\n"
+          "  int error;\n"
+          "} astrocol_writer;\n"
+          "static void astrocol_write(astrocol_writer* w, const void* data,"
+          " size_t n) {\n"
+          "  if (n && !w->error && n != fwrite(data, 1, n, w->out))\n"
+          "    w->error = 1;\n"
+          "  w->offset += n;\n"
+          "}\n"
+          "static void astrocol_write_u32(astrocol_writer* w, size_t v) {\n"
+          "  unsigned char b[4];\n"
+          "  b[0] = (unsigned char)v;\n"
+          "  b[1] = (unsigned char)(v >> 8);\n"
+          "  b[2] = (unsigned char)(v >> 16);\n"
+          "  b[3] = (unsigned char)(v >> 24);\n"
+          "  astrocol_write(w, b, 4);\n"
+          "}\n"
+          "static void astrocol_write_u64(astrocol_writer* w, size_t v) {\n"
+          "  astrocol_write_u32(w, v & 0xFFFFFFFFul);\n"
+          "  astrocol_write_u32(w, (v >> 16) >> 16);\n"
+          "}\n");
+  if (uses_child_fields())
+    xprintf(out,
+          "static void astrocol_save_ref(astrocol_writer* w, %s* node,\n"
+          "                              size_t self, astrocol_ptrmap* indices)"
+          " {\n"
+          "  /* References are relative to the referring node; 0 is NULL */\n"
+          "  astrocol_write_u32(w, node?\n"
+          "    (*astrocol_ptrmap_find(indices, node) - self) & 0xFFFFFFFFul :"
+          " 0);\n"
+          "}\n",
+          protocol_name);
+  if ((uses_strings() || uses_slices()))
+    xprintf(out,
+          "static void astrocol_save_string(astrocol_writer* w, const char* str,\n"
+          "                                 size_t len, size_t* payload) {\n"
+          "  astrocol_write_u32(w, str? len+1 : 0);\n"
+          "  if (!str) return;\n"
+          "  astrocol_write(w, str, len);\n"
+          "  astrocol_write(w, \"\", 1);\n"
+          "  *payload += len+1;\n"
+          "}\n");
+
+  xprintf(out,
+          "static void astrocol_save_record(astrocol_writer* w, %s* node,\n"
+          "                                 size_t self,"
+          " astrocol_ptrmap* indices,\n"
+          "                                 size_t* payload, size_t* extra) {\n"
+          "  size_t i;\n"
+          "  long n;\n"
+          "  (void)i; (void)n;\n",
+          protocol_name);
+  if (find_serializer("YYLTYPE"))
+    xprintf(out,
+            "  n = %s_save(&node->where, w->out);\n"
+            "  if (n < 0) w->error = 1;\n"
+            "  else w->offset += n;\n",
+            find_serializer("YYLTYPE"));
+  else
+    xprintf(out,
+            "  astrocol_write(w, &node->where, sizeof(YYLTYPE));\n");
+  xprintf(out,
+          "  switch (node->vtable->element) {\n");
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out,
+            "  case %u: {\n"
+            "    %s_t* this = (%s_t*)node;\n"
+            "    (void)this;\n",
+            element_index(elt), elt->name, elt->name);
+    write_save_field(out, elt->members);
+    xprintf(out, "  } break;\n");
+  }
+  xprintf(out, "  }\n}\n");
+
+  xprintf(out,
+          "int %s_save(%s* root, FILE* out) {\n"
+          "  astrocol_writer w;\n"
+          "  astrocol_node_list order;\n"
+          "  astrocol_ptrmap indices;\n"
+          "  size_t* offsets = NULL, * extras = NULL;\n"
+          "  size_t i, payload = 0, index_offset;\n"
+          "  int error;\n"
+          "  assert(root);\n"
+          "  w.out = out;\n"
+          "  w.offset = 0;\n"
+          "  w.error = 0;\n"
+          "  memset(&order, 0, sizeof(order));\n"
+          "  memset(&indices, 0, sizeof(indices));\n"
+          "  error = astrocol_number_nodes(root, &order, &indices, 1);\n"
+          "  if (!error) {\n"
+          "    offsets = malloc(order.count * sizeof(size_t));\n"
+          "    extras = malloc(order.count * sizeof(size_t));\n"
+          "    error = !offsets || !extras;\n"
+          "  }\n"
+          "  if (!error) {\n"
+          "    astrocol_write(&w, \"ASTROCOL\", 8);\n"
+          "    astrocol_write_u32(&w, ASTROCOL_SNAPSHOT_SIGNATURE);\n"
+          "    astrocol_write_u32(&w, sizeof(YYLTYPE) << 8 | sizeof(long));\n"
+          "    for (i = 0; i < order.count; ++i) {\n"
+          "      offsets[i] = w.offset - ASTROCOL_SNAPSHOT_HEADER;\n"
+          "      extras[i] = 0;\n"
+          "      astrocol_save_record(&w, order.items[i], i, &indices,\n"
+          "                           &payload, extras + i);\n"
+          "    }\n"
+          "    index_offset = w.offset;\n"
+          "    for (i = 0; i < order.count; ++i) {\n"
+          "      astrocol_write_u32(&w, order.items[i]->vtable->element);\n"
+          "      astrocol_write_u32(&w, extras[i]);\n"
+          "      astrocol_write_u64(&w, offsets[i]);\n"
+          "    }\n"
+          "    astrocol_write_u64(&w, index_offset);\n"
+          "    astrocol_write_u64(&w, order.count);\n"
+          "    astrocol_write_u64(&w, payload);\n"
+          "    error = w.error;\n"
+          "  }\n"
+          "  free(offsets);\n"
+          "  free(extras);\n"
+          "  free(order.items);\n"
+          "  free(indices.slots);\n"
+          "  return error? -1 : 0;\n"
+          "}\n",
+          protocol_name, protocol_name);
+}
+
+static void define_snapshot_reader(FILE* out) {
+  element* elt;
+
+  xprintf(out,
+          "typedef struct {\n"
+          "  const unsigned char* p, * end;\n"
+          "  int error;\n"
+          "} astrocol_reader;\n"
+          "static const unsigned char* astrocol_read(astrocol_reader* r,"
+          " size_t n) {\n"
+          "  const unsigned char* ret = r->p;\n"
+          "  if (r->error || (size_t)(r->end - r->p) < n) {\n"
+          "    r->error = 1;\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  r->p += n;\n"
+          "  return ret;\n"
+          "}\n"
+          "static void astrocol_read_bytes(astrocol_reader* r, void* dst,"
+          " size_t n) {\n"
+          "  const unsigned char* src = astrocol_read(r, n);\n"
+          "  if (src) memcpy(dst, src, n);\n"
+          "}\n"
+          "static size_t astrocol_get_u32(const unsigned char* b) {\n"
+          "  return (size_t)b[0] | (size_t)b[1] << 8 |\n"
+          "    (size_t)b[2] << 16 | (size_t)b[3] << 24;\n"
+          "}\n"
+          "static size_t astrocol_get_u64(const unsigned char* b) {\n"
+          "  return astrocol_get_u32(b) | (astrocol_get_u32(b+4) << 16) << 16;\n"
+          "}\n");
+  if (uses_child_fields() || uses_strings() || uses_slices())
+    xprintf(out,
+          "static size_t astrocol_read_u32(astrocol_reader* r) {\n"
+          "  const unsigned char* b = astrocol_read(r, 4);\n"
+          "  return b? astrocol_get_u32(b) : 0;\n"
+          "}\n");
+
+  /* Offsets and sizes are validated when the snapshot is opened, so that
+   * node allocation and decoding can trust the index.
+   */
+  xprintf(out,
+          "typedef struct {\n"
+          "  %s_context_t* context;\n"
+          "  const unsigned char* records, * index;\n"
+          "  size_t count, records_size, payload_size;\n"
+          "  %s** nodes;\n"
+          "  char* payload;\n"
+          "} astrocol_snapshot;\n"
+          "#define ASTROCOL_SNAPSHOT_INDEX_ENTRY 16\n"
+          "#define ASTROCOL_SNAPSHOT_TRAILER 24\n"
+          "static size_t astrocol_snapshot_tag(astrocol_snapshot* s, size_t i) {\n"
+          "  return astrocol_get_u32(s->index + i*ASTROCOL_SNAPSHOT_INDEX_ENTRY);\n"
+          "}\n"
+          "static size_t astrocol_snapshot_extra(astrocol_snapshot* s,"
+          " size_t i) {\n"
+          "  return astrocol_get_u32(s->index + i*ASTROCOL_SNAPSHOT_INDEX_ENTRY"
+          " + 4);\n"
+          "}\n"
+          "static size_t astrocol_snapshot_offset(astrocol_snapshot* s,"
+          " size_t i) {\n"
+          "  if (i == s->count) return s->records_size;\n"
+          "  return astrocol_get_u64(s->index + i*ASTROCOL_SNAPSHOT_INDEX_ENTRY"
+          " + 8);\n"
+          "}\n"
+          "static size_t astrocol_snapshot_node_size(astrocol_snapshot* s,"
+          " size_t i) {\n"
+          "  return ASTROCOL_ROUND(\n"
+          "    astrocol_element_sizes[astrocol_snapshot_tag(s, i)] +\n"
+          "    astrocol_snapshot_extra(s, i) * sizeof(%s*));\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name);
+
+  xprintf(out,
+          "static int astrocol_snapshot_open(astrocol_snapshot* s,\n"
+          "                                  %s_context_t* context,\n"
+          "                                  const unsigned char* data,"
+          " size_t len) {\n"
+          "  const unsigned char* trailer;\n"
+          "  size_t index_offset, i, extra = 0;\n"
+          "  memset(s, 0, sizeof(*s));\n"
+          "  s->context = context;\n"
+          "  if (len < ASTROCOL_SNAPSHOT_HEADER + ASTROCOL_SNAPSHOT_TRAILER ||\n"
+          "      memcmp(data, \"ASTROCOL\", 8) ||\n"
+          "      ASTROCOL_SNAPSHOT_SIGNATURE != astrocol_get_u32(data + 8) ||\n"
+          "      (sizeof(YYLTYPE) << 8 | sizeof(long)) !=\n"
+          "        astrocol_get_u32(data + 12))\n"
+          "    return -1;\n"
+          "  trailer = data + len - ASTROCOL_SNAPSHOT_TRAILER;\n"
+          "  index_offset = astrocol_get_u64(trailer);\n"
+          "  s->count = astrocol_get_u64(trailer + 8);\n"
+          "  s->payload_size = astrocol_get_u64(trailer + 16);\n"
+          "  if (index_offset < ASTROCOL_SNAPSHOT_HEADER ||\n"
+          "      index_offset > len - ASTROCOL_SNAPSHOT_TRAILER ||\n"
+          "      s->count != (len - ASTROCOL_SNAPSHOT_TRAILER - index_offset) /\n"
+          "                  ASTROCOL_SNAPSHOT_INDEX_ENTRY ||\n"
+          "      s->payload_size > len)\n"
+          "    return -1;\n"
+          "  s->records = data + ASTROCOL_SNAPSHOT_HEADER;\n"
+          "  s->records_size = index_offset - ASTROCOL_SNAPSHOT_HEADER;\n"
+          "  s->index = data + index_offset;\n"
+          "  for (i = 0; i < s->count; ++i) {\n"
+          "    extra += astrocol_snapshot_extra(s, i);\n"
+          "    if (astrocol_snapshot_tag(s, i) >= %u ||\n"
+          "        astrocol_snapshot_offset(s, i) >\n"
+          "          astrocol_snapshot_offset(s, i+1) ||\n"
+          "        extra > len)\n"
+          "      return -1;\n"
+          "  }\n"
+          "  return 0;\n"
+          "}\n",
+          protocol_name, count_elements());
+
+  /* Child references are relative to the referring node; children get
+   * their parent set here, since they may not have been decoded yet.
+   */
+  if (uses_child_fields()) {
+    xprintf(out,
+            "static %s* astrocol_load_ref(astrocol_snapshot* s, astrocol_reader* r,\n"
+            "                             size_t self) {\n"
+            "  size_t delta = astrocol_read_u32(r), ix;\n"
+            "  %s* child;\n"
+            "  if (!delta) return NULL;\n"
+            "  ix = (self + delta) & 0xFFFFFFFFul;\n"
+            "  if (ix >= s->count) {\n"
+            "    r->error = 1;\n"
+            "    return NULL;\n"
+            "  }\n"
+            "  child = s->nodes[ix];\n",
+            protocol_name, protocol_name);
+    if (uses_interning())
+      xprintf(out,
+              "  if (!astrocol_element_interned[astrocol_snapshot_tag(s, ix)])\n"
+              "    child->parent = s->nodes[self];\n");
+    else
+      xprintf(out,
+              "  child->parent = s->nodes[self];\n");
+    xprintf(out,
+            "  return child;\n"
+            "}\n");
+  }
+
+  if ((uses_strings() || uses_slices()))
+    xprintf(out,
+          "static char* astrocol_load_string(astrocol_snapshot* s,"
+          " astrocol_reader* r,\n"
+          "                                  size_t* len) {\n"
+          "  size_t n = astrocol_read_u32(r);\n"
+          "  const unsigned char* data;\n"
+          "  char* ret;\n"
+          "  if (len) *len = 0;\n"
+          "  if (!n) return NULL;\n"
+          "  data = astrocol_read(r, n);\n"
+          "  if (!data || data[n-1]) {\n"
+          "    r->error = 1;\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  if (len) *len = n-1;\n"
+          "  /* Without a payload area, strings are used in place */\n"
+          "  if (!s->payload) return (char*)data;\n"
+          "  if (n > s->payload_size) {\n"
+          "    r->error = 1;\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  ret = s->payload;\n"
+          "  memcpy(ret, data, n);\n"
+          "  s->payload += n;\n"
+          "  s->payload_size -= n;\n"
+          "  return ret;\n"
+          "}\n");
+
+  xprintf(out,
+          "static int astrocol_decode(astrocol_snapshot* s, size_t self) {\n"
+          "  %s* node = s->nodes[self];\n"
+          "  astrocol_reader r;\n"
+          "  %s** items = (%s**)((char*)node +\n"
+          "    astrocol_element_sizes[astrocol_snapshot_tag(s, self)]);\n"
+          "  size_t i, n, extra = astrocol_snapshot_extra(s, self);\n"
+          "  (void)i; (void)n; (void)items;\n"
+          "  r.p = s->records + astrocol_snapshot_offset(s, self);\n"
+          "  r.end = s->records + astrocol_snapshot_offset(s, self+1);\n"
+          "  r.error = 0;\n",
+          protocol_name, protocol_name, protocol_name);
+  if (find_serializer("YYLTYPE"))
+    xprintf(out,
+            "  if (%s_load(&node->where, &r.p, r.end,\n"
+            "              (%s_CONTEXT_T*)s->context))\n"
+            "    return -1;\n",
+            find_serializer("YYLTYPE"), protocol_name);
+  else
+    xprintf(out,
+            "  astrocol_read_bytes(&r, &node->where, sizeof(YYLTYPE));\n");
+  xprintf(out,
+          "  switch (astrocol_snapshot_tag(s, self)) {\n");
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out,
+            "  case %u: {\n"
+            "    %s_t* this = (%s_t*)node;\n"
+            "    (void)this;\n"
+            "    node->vtable = &%s_vtable;\n",
+            element_index(elt), elt->name, elt->name, elt->name);
+    write_load_field(out, elt->members);
+    xprintf(out, "  } break;\n");
+  }
+  xprintf(out,
+          "  }\n"
+          "  return r.error || extra? -1 : 0;\n"
+          "}\n");
+
+  /* All nodes go into a single block, in the order they were saved */
+  xprintf(out,
+          "%s* %s_load(%s_CONTEXT_T* context_, const void* data, size_t len) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  astrocol_snapshot s;\n"
+          "  astrocol_node_block* block;\n"
+          "  char* mem;\n"
+          "  size_t i, size = 0;\n"
+          "  %s* root;\n"
+          "  if (astrocol_snapshot_open(&s, context, data, len) || !s.count)\n"
+          "    return NULL;\n"
+          "  for (i = 0; i < s.count; ++i)\n"
+          "    size += astrocol_snapshot_node_size(&s, i);\n"
+          "  s.nodes = astrocol_malloc(context, s.count * sizeof(%s*));\n"
+          "  block = astrocol_node_block_new(context, size + s.payload_size);\n"
+          "  mem = ASTROCOL_BLOCK_NODES(block);\n"
+          "  for (i = 0; i < s.count; ++i) {\n"
+          "    s.nodes[i] = (%s*)mem;\n"
+          "    mem += astrocol_snapshot_node_size(&s, i);\n"
+          "  }\n"
+          "  memset(ASTROCOL_BLOCK_NODES(block), 0, size);\n"
+          "  s.payload = mem;\n"
+          "  for (i = 0; i < s.count; ++i) {\n"
+          "    if (astrocol_decode(&s, i)) {\n"
+          "      free(s.nodes);\n"
+          "      return NULL;\n"
+          "    }\n"
+          "  }\n"
+          "  block->count = s.count;\n"
+          "%s",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name,
+          generate_statistics? "  astrocol_count_block(block, 1);\n" : "");
+  if (uses_interning())
+    xprintf(out,
+            "  for (i = 0; i < s.count; ++i)\n"
+            "    if (s.nodes[i]->vtable->interned)\n"
+            "      astrocol_intern_node(context, s.nodes[i]);\n");
+  /* Construction order is children before parents, ie, reverse preorder */
+  xprintf(out,
+          "  for (i = s.count; i; --i)\n"
+          "    if (s.nodes[i-1]->vtable->ctor)\n"
+          "      ctor(s.nodes[i-1]);\n"
+          "  root = s.nodes[0];\n"
+          "  free(s.nodes);\n"
+          "  return root;\n"
+          "}\n");
+}
+
+/*
+  Lazily-loaded nodes start out with a vtable whose methods first decode the
+  node and then dispatch to the real implementation.
+ */
+static void define_lazy_thunks(FILE* out) {
+  method* meth;
+
+  for (meth = methods; meth; meth = meth->next) {
+    if (meth->is_implicit) continue;
+
+    xprintf(out, "static %s astrocol_lazy_%s(%s* this",
+            meth->return_type, meth->name, protocol_name);
+    write_args(out, meth->fields, 0);
+    xprintf(out,
+            ") {\n"
+            "  %s_materialise(this);\n"
+            "  ",
+            protocol_name);
+    if (!is_void(meth->return_type))
+      xprintf(out, "return ");
+    xprintf(out, "%s(this", meth->name);
+    write_callsite_args(out, meth->fields);
+    xprintf(out, ");\n}\n");
+  }
+}
+
+static void define_lazy_vtables(FILE* out) {
+  element* elt;
+  method* meth;
+  unsigned ix;
+
+  xprintf(out,
+          "static const %s_vtable astrocol_lazy_vtables[] = {\n",
+          protocol_name);
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out, "  {\n");
+    for (meth = methods, ix = 0; meth; meth = meth->next, ++ix) {
+      /* The node has not been constructed, so must not be destructed */
+      if (meth->is_implicit ||
+          mit_undefined == elt->implementations[ix].type) {
+        xprintf(out, "    NULL,\n");
+      } else {
+        xprintf(out, "    astrocol_lazy_%s,\n", meth->name);
+      }
+    }
+    xprintf(out, "    %u,\n", element_index(elt));
+    if (uses_interning())
+      xprintf(out, "    %d,\n", elt->is_interned);
+    xprintf(out, "  },\n");
+  }
+  xprintf(out, "};\n");
+}
+
+static void define_lazy_funs(FILE* out) {
+  xprintf(out,
+          "typedef struct {\n"
+          "  astrocol_snapshot* snapshot;\n"
+          "  size_t index;\n"
+          "} astrocol_lazy_ref;\n"
+          "typedef struct {\n"
+          "  astrocol_snapshot snapshot;\n"
+          "  astrocol_lazy_ref* refs;\n"
+          "  void* map;\n"
+          "  size_t map_size;\n"
+          "} astrocol_lazy_file;\n");
+
+  define_lazy_thunks(out);
+  define_lazy_vtables(out);
+
+  /* Until materialised, gc_next points to the node's astrocol_lazy_ref.
+   * Returns nonzero if the node's record is corrupt.
+   */
+  xprintf(out,
+          "static int astrocol_materialise(%s* node) {\n"
+          "  astrocol_lazy_ref* ref;\n"
+          "  if (node->vtable != &astrocol_lazy_vtables[node->vtable->element])\n"
+          "    return 0;\n"
+          "  ref = (astrocol_lazy_ref*)(void*)node->gc_next;\n"
+          "  node->gc_next = NULL;\n"
+          "  ref->snapshot->context =\n"
+          "    astrocol_owner(ref->snapshot->context);\n"
+          "  if (astrocol_decode(ref->snapshot, ref->index))\n"
+          "    return -1;\n",
+          protocol_name);
+  if (uses_interning())
+    xprintf(out,
+            "  if (node->vtable->interned)\n"
+            "    astrocol_intern_node(ref->snapshot->context, node);\n");
+  if (generate_statistics)
+    xprintf(out,
+            "  astrocol_count(ref->snapshot->context, node->vtable->element,\n"
+            "                 astrocol_node_size(node), 1);\n");
+  xprintf(out,
+          "  if (node->vtable->ctor)\n"
+          "    ctor(node);\n"
+          "  return 0;\n"
+          "}\n"
+          "void %s_materialise(%s* node) {\n"
+          "  if (astrocol_materialise(node)) {\n"
+          "    fprintf(stderr, \"Astrocol: Corrupt snapshot.\\n\");\n"
+          "    abort();\n"
+          "  }\n"
+          "}\n",
+          protocol_name, protocol_name);
+
+  /* The file is destroyed before the node block, since it is allocated after
+   * it; only nodes which were materialised have their destructors run.
+   */
+  xprintf(out,
+          "static void astrocol_lazy_file_dtor(void* vfile) {\n"
+          "  astrocol_lazy_file* file = vfile;\n"
+          "  size_t i;\n"
+          "  for (i = 0; i < file->snapshot.count; ++i) {\n");
+  if (uses_interning())
+    xprintf(out,
+            "    if (astrocol_owner(file->snapshot.context)->interned.slots &&\n"
+            "        file->snapshot.nodes[i]->vtable->interned &&\n"
+            "        file->snapshot.nodes[i]->vtable !=\n"
+            "          &astrocol_lazy_vtables[file->snapshot.nodes[i]->vtable->"
+            "element])\n"
+            "      astrocol_unintern_node(\n"
+            "        astrocol_owner(file->snapshot.context),"
+            " file->snapshot.nodes[i]);\n");
+  if (generate_statistics)
+    xprintf(out,
+            "    if (file->snapshot.nodes[i]->vtable !=\n"
+            "          &astrocol_lazy_vtables[file->snapshot.nodes[i]->vtable->"
+            "element])\n"
+            "      astrocol_count(astrocol_owner(file->snapshot.context),\n"
+            "                     file->snapshot.nodes[i]->vtable->element,\n"
+            "                     astrocol_node_size(file->snapshot.nodes[i]),"
+            " 0);\n");
+  xprintf(out,
+          "    if (file->snapshot.nodes[i]->vtable->dtor)\n"
+          "      dtor(file->snapshot.nodes[i]);\n"
+          "  }\n"
+          "  free(file->snapshot.nodes);\n"
+          "  free(file->refs);\n"
+          "  if (file->map) munmap(file->map, file->map_size);\n"
+          "}\n");
+
+  xprintf(out,
+          "%s* %s_open(%s_CONTEXT_T* context_, const char* filename) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  astrocol_snapshot s;\n"
+          "  astrocol_node_block* block;\n"
+          "  astrocol_lazy_file* file;\n"
+          "  struct stat st;\n"
+          "  void* map;\n"
+          "  char* mem;\n"
+          "  size_t i, size = 0;\n"
+          "  int fd;\n"
+          "  fd = open(filename, O_RDONLY);\n"
+          "  if (fd < 0) return NULL;\n"
+          "  if (fstat(fd, &st) || !st.st_size) {\n"
+          "    close(fd);\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  /* Private and writable, so that strings can be used in place */\n"
+          "  map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,"
+          " fd, 0);\n"
+          "  close(fd);\n"
+          "  if (MAP_FAILED == map) return NULL;\n"
+          "  if (astrocol_snapshot_open(&s, context, map, st.st_size) ||"
+          " !s.count) {\n"
+          "    munmap(map, st.st_size);\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  for (i = 0; i < s.count; ++i)\n"
+          "    size += astrocol_snapshot_node_size(&s, i);\n"
+          "  block = astrocol_node_block_new(context, size);\n"
+          "  mem = ASTROCOL_BLOCK_NODES(block);\n"
+          "  memset(mem, 0, size);\n"
+          "  s.nodes = astrocol_malloc(context, s.count * sizeof(%s*));\n"
+          "  file = astrocol_dalloc(context, sizeof(astrocol_lazy_file),\n"
+          "                         astrocol_lazy_file_dtor);\n"
+          "  file->snapshot = s;\n"
+          "  file->snapshot.count = 0;\n"
+          "  file->refs = astrocol_malloc(context,\n"
+          "                               s.count * sizeof(astrocol_lazy_ref));\n"
+          "  file->map = map;\n"
+          "  file->map_size = st.st_size;\n"
+          "  for (i = 0; i < s.count; ++i) {\n"
+          "    s.nodes[i] = (%s*)mem;\n"
+          "    s.nodes[i]->vtable = &astrocol_lazy_vtables[\n"
+          "      astrocol_snapshot_tag(&s, i)];\n"
+          "    s.nodes[i]->gc_next = (%s*)(void*)(file->refs + i);\n"
+          "    file->refs[i].snapshot = &file->snapshot;\n"
+          "    file->refs[i].index = i;\n"
+          "    mem += astrocol_snapshot_node_size(&s, i);\n"
+          "  }\n"
+          "  file->snapshot.count = s.count;\n"
+          "  /* A corrupt root is reported here rather than on first use; the\n"
+          "   * emptied file and block remain until the context is destroyed.\n"
+          "   */\n"
+          "  if (astrocol_materialise(s.nodes[0])) {\n"
+          "    file->snapshot.count = 0;\n"
+          "    free(file->snapshot.nodes);\n"
+          "    free(file->refs);\n"
+          "    file->snapshot.nodes = NULL;\n"
+          "    file->refs = NULL;\n"
+          "    munmap(map, st.st_size);\n"
+          "    file->map = NULL;\n"
+          "    return NULL;\n"
+          "  }\n"
+          "  return s.nodes[0];\n"
+          "}\n",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name, protocol_name,
+          protocol_name,
+          protocol_name,
+          protocol_name);
+}
+
+static void define_snapshot_funs(FILE* out) {
+  element* elt;
+
+  xprintf(out,
+          "#define ASTROCOL_SNAPSHOT_SIGNATURE 0x%08lXul\n"
+          "#define ASTROCOL_SNAPSHOT_HEADER 16\n",
+          snapshot_signature());
+  if (uses_interning() && uses_child_fields()) {
+    xprintf(out, "static const unsigned char astrocol_element_interned[] = {\n");
+    for (elt = elements; elt; elt = elt->next)
+      xprintf(out, "  %d,\n", elt->is_interned);
+    xprintf(out, "};\n");
+  }
+
+  define_snapshot_writer(out);
+  define_snapshot_reader(out);
+  define_lazy_funs(out);
+}
+
+static void write_record_field(FILE* out, field* member) {
+  if (!member) return;
+
+  write_record_field(out, member->next);
+
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type))
+    xprintf(out,
+            "    astrocol_record_ref(r, this->%s);\n",
+            member->name);
+  else if (is_protocol_sequence(member->type))
+    xprintf(out,
+            "    astrocol_record_varint(r->out, this->%s.count);\n"
+            "    for (i = 0; i < this->%s.count; ++i)\n"
+            "      astrocol_record_ref(r, this->%s.items[i]);\n",
+            member->name, member->name, member->name);
+  else if (is_string(member->type))
+    xprintf(out,
+            "    astrocol_record_string(r->out, this->%s,\n"
+            "                           this->%s? strlen(this->%s) : 0);\n",
+            member->name, member->name, member->name);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "    astrocol_record_string(r->out, this->%s.str,"
+            " this->%s.len);\n",
+            member->name, member->name);
+  else if (is_opaque(member->type) && find_serializer(member->type))
+    xprintf(out,
+            "    if (%s_save(&this->%s, r->out) < 0) r->error = 1;\n",
+            find_serializer(member->type), member->name);
+  else if (!is_opaque(member->type))
+    xprintf(out,
+            "    fwrite(&this->%s, sizeof(this->%s), 1, r->out);\n",
+            member->name, member->name);
+}
+
+static void write_replay_decls(FILE* out, field* member) {
+  for (; member; member = member->next) {
+    if (':' == member->name[0] || '_' == member->name[0]) continue;
+
+    if (is_protocol_sequence(member->type))
+      xprintf(out, "      %s_seq* %s = NULL;\n", protocol_name, member->name);
+    else if (is_opaque(member->type))
+      xprintf(out, "      %s %s = 0;\n", member->type, member->name);
+    else
+      xprintf(out, "      %s %s;\n", member->type, member->name);
+  }
+}
+
+static void write_replay_field(FILE* out, field* member) {
+  if (!member) return;
+
+  write_replay_field(out, member->next);
+
+  if (':' == member->name[0] || '_' == member->name[0]) return;
+
+  if (is_protocol_instance(member->type))
+    xprintf(out,
+            "      %s = astrocol_replay_ref(&astrocol_r, astrocol_nodes,\n"
+            "                               astrocol_count);\n",
+            member->name);
+  else if (is_protocol_sequence(member->type))
+    xprintf(out,
+            "      for (astrocol_n = astrocol_replay_varint(&astrocol_r);\n"
+            "           astrocol_n && !astrocol_r.error; --astrocol_n)\n"
+            "        %s = %s_seq_append_in(\n"
+            "          astrocol_context, %s,\n"
+            "          astrocol_replay_ref(&astrocol_r, astrocol_nodes,"
+            " astrocol_count));\n",
+            member->name, protocol_name, member->name);
+  else if (is_string(member->type))
+    xprintf(out,
+            "      %s = astrocol_replay_string(&astrocol_r, astrocol_context,"
+            " NULL);\n",
+            member->name);
+  else if (is_slice(member->type))
+    xprintf(out,
+            "      %s.str = astrocol_replay_string(&astrocol_r,"
+            " astrocol_context,\n"
+            "                                      &%s.len);\n",
+            member->name, member->name);
+  else if (is_opaque(member->type) && find_serializer(member->type))
+    xprintf(out,
+            "      if (!astrocol_r.error &&\n"
+            "          %s_load(&%s, &astrocol_r.p, astrocol_r.end,"
+            " astrocol_context))\n"
+            "        astrocol_r.error = 1;\n",
+            find_serializer(member->type), member->name);
+  else if (!is_opaque(member->type))
+    xprintf(out,
+            "      astrocol_replay_bytes(&astrocol_r, &%s, sizeof(%s));\n",
+            member->name, member->name);
+}
+
+/*
+  A recording starts with a header like a snapshot's, followed by one record
+  per constructor call: the element index, the location, then the arguments
+  in order. Integers are written as base-128 varints, and references to
+  elements give the (1-based) number of the record which last returned
+  them, 0 being NULL. Other values are written as raw bytes, or by their
+  serializer; pointers without one cannot be reproduced, so are left out and
+  replayed as NULL.
+ */
+static void define_recording_funs(FILE* out) {
+  element* elt;
+
+  xprintf(out,
+          "#define ASTROCOL_RECORD_MAGIC \"ASTROREC\"\n"
+          "#define ASTROCOL_RECORD_SIGNATURE %lulu\n"
+          "struct astrocol_recorder_s {\n"
+          "  FILE* out;\n"
+          "  size_t count;\n"
+          "  astrocol_ptrmap ids;\n"
+          "  int error;\n"
+          "};\n"
+          "static void astrocol_record_varint(FILE* out, size_t v) {\n"
+          "  while (v >= 0x80) {\n"
+          "    putc((int)(v & 0x7F) | 0x80, out);\n"
+          "    v >>= 7;\n"
+          "  }\n"
+          "  putc((int)v, out);\n"
+          "}\n",
+          snapshot_signature());
+  if (uses_child_fields())
+    xprintf(out,
+            "static void astrocol_record_ref(struct astrocol_recorder_s* r,"
+            " %s* node) {\n"
+            "  size_t* id = node? astrocol_ptrmap_find(&r->ids, node) : NULL;\n"
+            "  astrocol_record_varint(r->out, id? *id : 0);\n"
+            "}\n",
+            protocol_name);
+  if (uses_strings() || uses_slices())
+    xprintf(out,
+            "static void astrocol_record_string(FILE* out, const char* str,"
+            " size_t len) {\n"
+            "  astrocol_record_varint(out, str? len+1 : 0);\n"
+            "  if (str) fwrite(str, 1, len, out);\n"
+            "}\n");
+
+  xprintf(out,
+          "static void astrocol_record(%s_context_t* context, %s* node) {\n"
+          "  struct astrocol_recorder_s* r = context->recorder;\n"
+          "  size_t* id;\n"
+          "%s"
+          "  ASTROCOL_LOCK(context, recorder);\n"
+          "  astrocol_record_varint(r->out, node->vtable->element);\n",
+          protocol_name, protocol_name,
+          uses_sequences()? "  unsigned i;\n" : "");
+  if (find_serializer("YYLTYPE"))
+    xprintf(out,
+            "  if (%s_save(&node->where, r->out) < 0) r->error = 1;\n",
+            find_serializer("YYLTYPE"));
+  else
+    xprintf(out,
+            "  fwrite(&node->where, sizeof(YYLTYPE), 1, r->out);\n");
+  xprintf(out,
+          "  switch (node->vtable->element) {\n");
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out,
+            "  case %u: {\n"
+            "    %s_t* this = (%s_t*)node;\n",
+            element_index(elt), elt->name, elt->name);
+    write_record_field(out, elt->members);
+    xprintf(out,
+            "    (void)this;\n"
+            "  } break;\n");
+  }
+  xprintf(out,
+          "  }\n"
+          "  /* A node may be returned again by interning */\n"
+          "  id = astrocol_ptrmap_find(&r->ids, node);\n"
+          "  if (id) *id = ++r->count;\n"
+          "  else if (astrocol_ptrmap_put(&r->ids, node, ++r->count))"
+          " r->error = 1;\n"
+          "  ASTROCOL_UNLOCK(context, recorder);\n"
+          "}\n"
+          "static void astrocol_record_stop(%s_context_t* context) {\n"
+          "  if (!context->recorder) return;\n"
+          "  free(context->recorder->ids.slots);\n"
+          "  free(context->recorder);\n"
+          "  context->recorder = NULL;\n"
+          "}\n"
+          "int %s_record_to(%s_CONTEXT_T* context_, FILE* out) {\n"
+          "  %s_context_t* context = (%s_context_t*)context_;\n"
+          "  struct astrocol_recorder_s* r = context->recorder;\n"
+          "  int ret = 0;\n"
+          "  if (r) {\n"
+          "    if (r->error || fflush(r->out) || ferror(r->out)) ret = -1;\n"
+          "    astrocol_record_stop(context);\n"
+          "  }\n"
+          "  if (!out) return ret;\n"
+          "  r = calloc(1, sizeof(struct astrocol_recorder_s));\n"
+          "  if (!r) return -1;\n"
+          "  r->out = out;\n"
+          "  fputs(ASTROCOL_RECORD_MAGIC, out);\n"
+          "  astrocol_record_varint(out, ASTROCOL_RECORD_SIGNATURE);\n"
+          "  astrocol_record_varint(out, sizeof(YYLTYPE));\n"
+          "  context->recorder = r;\n"
+          "  return ret;\n"
+          "}\n",
+          protocol_name,
+          protocol_name, protocol_name,
+          protocol_name, protocol_name);
+
+  /* Replay */
+  xprintf(out,
+          "typedef struct {\n"
+          "  const unsigned char* p, * end;\n"
+          "  int error;\n"
+          "} astrocol_replayer;\n"
+          "static size_t astrocol_replay_varint(astrocol_replayer* r) {\n"
+          "  size_t v = 0;\n"
+          "  unsigned shift = 0;\n"
+          "  do {\n"
+          "    if (r->p == r->end || shift >= sizeof(size_t)*8) {\n"
+          "      r->error = 1;\n"
+          "      return 0;\n"
+          "    }\n"
+          "    v |= (size_t)(*r->p & 0x7F) << shift;\n"
+          "    shift += 7;\n"
+          "  } while (*r->p++ & 0x80);\n"
+          "  return v;\n"
+          "}\n"
+          "static void astrocol_replay_bytes(astrocol_replayer* r, void* dst,"
+          " size_t n) {\n"
+          "  if (r->error || (size_t)(r->end - r->p) < n) {\n"
+          "    r->error = 1;\n"
+          "    memset(dst, 0, n);\n"
+          "    return;\n"
+          "  }\n"
+          "  memcpy(dst, r->p, n);\n"
+          "  r->p += n;\n"
+          "}\n");
+  if (uses_child_fields())
+    xprintf(out,
+            "static %s* astrocol_replay_ref(astrocol_replayer* r, %s** nodes,\n"
+            "                               size_t count) {\n"
+            "  size_t id = astrocol_replay_varint(r);\n"
+            "  if (id > count) r->error = 1;\n"
+            "  return id && !r->error? nodes[id-1] : NULL;\n"
+            "}\n",
+            protocol_name, protocol_name);
+  if (uses_strings() || uses_slices())
+    xprintf(out,
+            "static char* astrocol_replay_string(astrocol_replayer* r,\n"
+            "                                    %s_CONTEXT_T* context,"
+            " size_t* len) {\n"
+            "  size_t n = astrocol_replay_varint(r);\n"
+            "  char* str;\n"
+            "  if (len) *len = n? n-1 : 0;\n"
+            "  if (!n || r->error) return NULL;\n"
+            "  if ((size_t)(r->end - r->p) < n-1) {\n"
+            "    r->error = 1;\n"
+            "    return NULL;\n"
+            "  }\n"
+            "  str = %s_malloc_in(context, n);\n"
+            "  memcpy(str, r->p, n-1);\n"
+            "  str[n-1] = 0;\n"
+            "  r->p += n-1;\n"
+            "  return str;\n"
+            "}\n",
+            protocol_name, protocol_name);
+
+  xprintf(out,
+          "%s* %s_replay(%s_CONTEXT_T* astrocol_context, const void* data,"
+          " size_t len) {\n"
+          "  astrocol_replayer astrocol_r;\n"
+          "  %s** astrocol_nodes = NULL, ** astrocol_grown,\n"
+          "    * astrocol_node = NULL;\n"
+          "  size_t astrocol_count = 0, astrocol_capacity = 0, astrocol_n;\n"
+          "  YYLTYPE astrocol_where;\n"
+          "  astrocol_r.p = data;\n"
+          "  astrocol_r.end = astrocol_r.p + len;\n"
+          "  astrocol_r.error = 0;\n"
+          "  if (len < sizeof(ASTROCOL_RECORD_MAGIC)-1 ||\n"
+          "      memcmp(data, ASTROCOL_RECORD_MAGIC,"
+          " sizeof(ASTROCOL_RECORD_MAGIC)-1))\n"
+          "    return NULL;\n"
+          "  astrocol_r.p += sizeof(ASTROCOL_RECORD_MAGIC)-1;\n"
+          "  if (ASTROCOL_RECORD_SIGNATURE !="
+          " astrocol_replay_varint(&astrocol_r) ||\n"
+          "      sizeof(YYLTYPE) != astrocol_replay_varint(&astrocol_r))\n"
+          "    return NULL;\n"
+          "  while (astrocol_r.p < astrocol_r.end && !astrocol_r.error) {\n"
+          "    astrocol_n = astrocol_replay_varint(&astrocol_r);\n",
+          protocol_name, protocol_name, protocol_name,
+          protocol_name);
+  if (find_serializer("YYLTYPE"))
+    xprintf(out,
+            "    if (!astrocol_r.error &&\n"
+            "        %s_load(&astrocol_where, &astrocol_r.p, astrocol_r.end,\n"
+            "                astrocol_context))\n"
+            "      astrocol_r.error = 1;\n",
+            find_serializer("YYLTYPE"));
+  else
+    xprintf(out,
+            "    astrocol_replay_bytes(&astrocol_r, &astrocol_where,\n"
+            "                          sizeof(astrocol_where));\n");
+  xprintf(out,
+          "    switch (astrocol_r.error? ~(size_t)0 : astrocol_n) {\n");
+  for (elt = elements; elt; elt = elt->next) {
+    xprintf(out, "    case %u: {\n", element_index(elt));
+    write_replay_decls(out, elt->members);
+    write_replay_field(out, elt->members);
+    xprintf(out,
+            "      if (astrocol_r.error) break;\n"
+            "      astrocol_node = %s_in(astrocol_context, astrocol_where",
+            elt->name);
+    write_ctor_callsite_args(out, elt->members);
+    xprintf(out,
+            ");\n"
+            "    } break;\n");
+  }
+  xprintf(out,
+          "    default:\n"
+          "      astrocol_r.error = 1;\n"
+          "    }\n"
+          "    if (astrocol_r.error) break;\n"
+          "    if (astrocol_count == astrocol_capacity) {\n"
+          "      astrocol_capacity = astrocol_capacity?"
+          " astrocol_capacity*2 : 256;\n"
+          "      astrocol_grown = realloc(astrocol_nodes,\n"
+          "                               astrocol_capacity * sizeof(%s*));\n"
+          "      if (!astrocol_grown) {\n"
+          "        (*((%s_context_t*)astrocol_context)->oom)();\n"
+          "        abort();\n"
+          "      }\n"
+          "      astrocol_nodes = astrocol_grown;\n"
+          "    }\n"
+          "    astrocol_nodes[astrocol_count++] = astrocol_node;\n"
+          "  }\n"
+          "  free(astrocol_nodes);\n"
+          "  return astrocol_r.error? NULL : astrocol_node;\n"
+          "}\n",
+          protocol_name, protocol_name);
 }
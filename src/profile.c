@@ -0,0 +1,246 @@
+/*
+Copyright (c) 2013 Jason Lingle
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of the author nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "profile.h"
+#include "data.h"
+
+/*
+  Profile entries and implementations name elements and methods; these are
+  looked up in arrays sorted by name, so that reading a profile does not
+  take time quadratic in the size of the protocol.
+ */
+typedef struct {
+  const char* name;
+  element* elt;
+  int ix;
+} named;
+
+static int compare_named(const void* va, const void* vb) {
+  return strcmp(((const named*)va)->name, ((const named*)vb)->name);
+}
+
+static named* sort_elements(unsigned* count) {
+  named* names;
+  element* elt;
+  unsigned n = 0;
+
+  for (elt = elements; elt; elt = elt->next)
+    ++n;
+
+  names = xmalloc((n? n : 1) * sizeof(named));
+  for (elt = elements, n = 0; elt; elt = elt->next, ++n) {
+    names[n].name = elt->name;
+    names[n].elt = elt;
+    names[n].ix = n;
+  }
+
+  qsort(names, n, sizeof(named), compare_named);
+  *count = n;
+  return names;
+}
+
+static named* sort_method_names(unsigned* count) {
+  named* names;
+  method* meth;
+  unsigned n = count_methods();
+
+  names = xmalloc((n? n : 1) * sizeof(named));
+  for (meth = methods, n = 0; meth; meth = meth->next, ++n) {
+    names[n].name = meth->name;
+    names[n].elt = NULL;
+    names[n].ix = n;
+  }
+
+  qsort(names, n, sizeof(named), compare_named);
+  *count = n;
+  return names;
+}
+
+static const named* find_name(const named* names, unsigned count,
+                              const char* name) {
+  named key;
+
+  key.name = name;
+  return bsearch(&key, names, count, sizeof(named), compare_named);
+}
+
+/*
+  Stably sorts the methods by their total calls, most first, so that the hot
+  entries of each vtable are adjacent. The per-element arrays indexed by
+  method are permuted to match.
+ */
+static void sort_methods(void) {
+  unsigned num_methods = count_methods(), i, j;
+  method** order = xmalloc(num_methods * sizeof(method*));
+  unsigned* old_index = xmalloc(num_methods * sizeof(unsigned));
+  unsigned long long* totals =
+    xmalloc(num_methods * sizeof(unsigned long long));
+  method_impl* impls;
+  unsigned long long* calls;
+  method* meth;
+  element* elt;
+
+  for (meth = methods, i = 0; meth; meth = meth->next, ++i) {
+    totals[i] = 0;
+    for (elt = elements; elt; elt = elt->next)
+      totals[i] += elt->calls[i];
+  }
+
+  /* Insertion sort; protocols have few methods */
+  for (meth = methods, i = 0; meth; meth = meth->next, ++i) {
+    for (j = i; j && totals[old_index[j-1]] < totals[i]; --j) {
+      order[j] = order[j-1];
+      old_index[j] = old_index[j-1];
+    }
+    order[j] = meth;
+    old_index[j] = i;
+  }
+
+  methods = order[0];
+  for (i = 0; i + 1 < num_methods; ++i)
+    order[i]->next = order[i+1];
+  order[num_methods-1]->next = NULL;
+
+  for (elt = elements; elt; elt = elt->next) {
+    impls = xmalloc(num_methods * sizeof(method_impl));
+    calls = xmalloc(num_methods * sizeof(unsigned long long));
+    for (i = 0; i < num_methods; ++i) {
+      impls[i] = elt->implementations[old_index[i]];
+      calls[i] = elt->calls[old_index[i]];
+    }
+    free(elt->implementations);
+    free(elt->calls);
+    elt->implementations = impls;
+    elt->calls = calls;
+  }
+
+  free(order);
+  free(old_index);
+  free(totals);
+}
+
+/*
+  Totals the calls to each method and to each implementation, and finds the
+  element receiving at least three quarters of the calls to each method,
+  once the methods are in their final order.
+ */
+static void summarise_profile(void) {
+  unsigned num_methods = count_methods(), num_elements, i;
+  named* names = sort_elements(&num_elements);
+  const named* implementor;
+  method* meth;
+  element* elt;
+
+  profile_total = 0;
+  for (elt = elements; elt; elt = elt->next) {
+    elt->impl_calls = xmalloc(num_methods * sizeof(unsigned long long));
+    memset(elt->impl_calls, 0, num_methods * sizeof(unsigned long long));
+  }
+
+  for (elt = elements; elt; elt = elt->next) {
+    for (meth = methods, i = 0; meth; meth = meth->next, ++i) {
+      meth->calls += elt->calls[i];
+      profile_total += elt->calls[i];
+
+      elt->impl_calls[i] += elt->calls[i];
+      implementor = find_name(names, num_elements,
+                              elt->implementations[i].implemented_by);
+      if (implementor && implementor->elt != elt)
+        implementor->elt->impl_calls[i] += elt->calls[i];
+    }
+  }
+
+  for (meth = methods, i = 0; meth; meth = meth->next, ++i) {
+    for (elt = elements; elt && !meth->dominant; elt = elt->next)
+      if (meth->calls && elt->calls[i] * 4 >= meth->calls * 3 &&
+          mit_undefined != elt->implementations[i].type)
+        meth->dominant = elt;
+  }
+
+  free(names);
+}
+
+void read_profile(const char* filename) {
+  FILE* in = fopen(filename, "r");
+  char line[512], elt_name[256], meth_name[256];
+  unsigned long long calls, ticks;
+  unsigned lineno = 0, num_methods = count_methods();
+  unsigned num_elements, num_method_names;
+  named* element_names, * method_names;
+  const named* found_elt, * found_meth;
+  element* elt;
+
+  if (!in) {
+    fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+    exit(EX_NOINPUT);
+  }
+
+  element_names = sort_elements(&num_elements);
+  method_names = sort_method_names(&num_method_names);
+  for (elt = elements; elt; elt = elt->next) {
+    elt->calls = xmalloc(num_methods * sizeof(unsigned long long));
+    memset(elt->calls, 0, num_methods * sizeof(unsigned long long));
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    ++lineno;
+    if (4 != sscanf(line, "%255s %255s %llu %llu",
+                    elt_name, meth_name, &calls, &ticks)) {
+      fprintf(stderr, "%s:%u: Malformed profile entry\n", filename, lineno);
+      exit(EX_DATAERR);
+    }
+
+    /* Entries for elements or methods which no longer exist are ignored,
+     * so that a profile from an older version of the protocol still works.
+     */
+    found_elt = find_name(element_names, num_elements, elt_name);
+    found_meth = find_name(method_names, num_method_names, meth_name);
+    if (found_elt && found_meth)
+      found_elt->elt->calls[found_meth->ix] += calls;
+  }
+
+  if (ferror(in)) {
+    fprintf(stderr, "Error reading %s: %s\n", filename, strerror(errno));
+    exit(EX_IOERR);
+  }
+  fclose(in);
+  free(element_names);
+  free(method_names);
+
+  if (num_methods)
+    sort_methods();
+  summarise_profile();
+}
@@ -139,6 +139,19 @@ static void read_configuration(yaml_parser_t* parser, yaml_event_t* key) {
 static void read_config_protocol_name(yaml_parser_t*);
 static void read_config_header(yaml_parser_t*);
 static void read_config_output(yaml_parser_t*);
+static void read_config_snapshot(yaml_parser_t*);
+static void read_config_serializers(yaml_parser_t*);
+static void read_config_thread_local(yaml_parser_t*);
+static void read_config_concurrent(yaml_parser_t*);
+static void read_config_adoption(yaml_parser_t*);
+static void read_config_statistics(yaml_parser_t*);
+static void read_config_profile_dispatch(yaml_parser_t*);
+static void read_config_profile_timing(yaml_parser_t*);
+static void read_config_profile(yaml_parser_t*);
+static void read_config_site_sampling(yaml_parser_t*);
+static void read_config_budget(yaml_parser_t*);
+static void read_config_tracing(yaml_parser_t*);
+static void read_config_recording(yaml_parser_t*);
 
 static const struct {
   const char* name;
@@ -147,6 +160,19 @@ static const struct {
   { "protocol_name", read_config_protocol_name },
   { "header", read_config_header },
   { "output", read_config_output },
+  { "snapshot", read_config_snapshot },
+  { "serializers", read_config_serializers },
+  { "thread_local", read_config_thread_local },
+  { "concurrent", read_config_concurrent },
+  { "adoption", read_config_adoption },
+  { "statistics", read_config_statistics },
+  { "profile_dispatch", read_config_profile_dispatch },
+  { "profile_timing", read_config_profile_timing },
+  { "profile", read_config_profile },
+  { "site_sampling", read_config_site_sampling },
+  { "budget", read_config_budget },
+  { "tracing", read_config_tracing },
+  { "recording", read_config_recording },
   { NULL, NULL },
 };
 
@@ -179,6 +205,41 @@ static void read_string_value(const char** dst,
   yaml_event_delete(&evt);
 }
 
+static const struct {
+  const char* name;
+  int value;
+} boolean_names[] = {
+  { "yes", 1 },
+  { "no", 0 },
+  { "true", 1 },
+  { "false", 0 },
+  { "on", 1 },
+  { "off", 0 },
+  { NULL }
+};
+
+static void read_boolean_value(int* dst, yaml_parser_t* parser) {
+  yaml_event_t evt;
+  const char* value;
+  char message[96];
+  unsigned i;
+
+  xyp_parse(&evt, parser);
+  EXPECT(evt, YAML_SCALAR_EVENT);
+  value = (const char*)evt.data.scalar.value;
+
+  for (i = 0; boolean_names[i].name; ++i) {
+    if (0 == strcmp(value, boolean_names[i].name)) {
+      *dst = boolean_names[i].value;
+      yaml_event_delete(&evt);
+      return;
+    }
+  }
+
+  snprintf(message, sizeof(message), "Expected boolean, got: %s", value);
+  format_error(message, &evt);
+}
+
 static void read_config_protocol_name(yaml_parser_t* parser) {
   read_string_value(&protocol_name, parser);
 }
@@ -191,6 +252,85 @@ static void read_config_output(yaml_parser_t* parser) {
   read_string_value(&protocol_impl_filename, parser);
 }
 
+static void read_config_snapshot(yaml_parser_t* parser) {
+  read_boolean_value(&generate_snapshots, parser);
+}
+
+static void read_config_thread_local(yaml_parser_t* parser) {
+  read_boolean_value(&thread_local_context, parser);
+}
+
+static void read_config_concurrent(yaml_parser_t* parser) {
+  read_boolean_value(&concurrent_context, parser);
+}
+
+static void read_config_adoption(yaml_parser_t* parser) {
+  read_boolean_value(&context_adoption, parser);
+}
+
+static void read_config_statistics(yaml_parser_t* parser) {
+  read_boolean_value(&generate_statistics, parser);
+}
+
+static void read_config_profile_dispatch(yaml_parser_t* parser) {
+  read_boolean_value(&profile_dispatch, parser);
+}
+
+static void read_config_profile_timing(yaml_parser_t* parser) {
+  read_boolean_value(&profile_timing, parser);
+}
+
+static void read_config_profile(yaml_parser_t* parser) {
+  read_string_value(&profile_filename, parser);
+}
+
+static void read_config_site_sampling(yaml_parser_t* parser) {
+  yaml_event_t evt;
+  const char* value;
+  char* end;
+  unsigned long interval;
+
+  xyp_parse(&evt, parser);
+  EXPECT(evt, YAML_SCALAR_EVENT);
+  value = (const char*)evt.data.scalar.value;
+
+  interval = strtoul(value, &end, 10);
+  if (!*value || *end || !interval || interval > 0xFFFFFFFFul)
+    format_error("Expected positive sampling interval", &evt);
+
+  site_sampling = interval;
+  yaml_event_delete(&evt);
+}
+
+static void read_config_budget(yaml_parser_t* parser) {
+  read_boolean_value(&memory_budget, parser);
+}
+
+static void read_config_tracing(yaml_parser_t* parser) {
+  read_boolean_value(&generate_tracing, parser);
+}
+
+static void read_config_recording(yaml_parser_t* parser) {
+  read_boolean_value(&generate_recording, parser);
+}
+
+static void read_config_serializers(yaml_parser_t* parser) {
+  yaml_event_t evt;
+  serializer* ser;
+
+  xyp_parse(&evt, parser);
+  EXPECT(evt, YAML_MAPPING_START_EVENT);
+  yaml_event_delete(&evt);
+
+  FORYMAP(parser, evt) {
+    ser = xmalloc(sizeof(serializer));
+    ser->type = xstrdup((const char*)evt.data.scalar.value);
+    read_string_value(&ser->prefix, parser);
+    ser->next = serializers;
+    serializers = ser;
+  }
+}
+
 static void read_definitions(yaml_parser_t* parser, yaml_event_t* key) {
   read_string_value(&definitions, parser);
 }
@@ -218,6 +358,23 @@ static void read_protocol(yaml_parser_t* parser, yaml_event_t* ignored) {
 static void read_protocol_method_decl(yaml_parser_t* parser,
                                       method* meth,
                                       yaml_event_t* key);
+
+/* Structural equals compares this against its sole argument, so the method
+ * must take exactly one argument, and that argument must be a protocol
+ * instance.
+ */
+static void check_structural_equals(const method* meth,
+                                    const yaml_event_t* evt) {
+  char message[128];
+
+  if (!meth->fields || meth->fields->next ||
+      !is_protocol_instance(meth->fields->type)) {
+    snprintf(message, sizeof(message),
+             "Method %s must take exactly one protocol argument "
+             "to be structural equals", meth->name);
+    format_error(message, evt);
+  }
+}
 static void read_protocol_method(yaml_parser_t* parser,
                                  yaml_event_t* key) {
   char message[64];
@@ -238,9 +395,12 @@ static void read_protocol_method(yaml_parser_t* parser,
   meth->name = xstrdup(name);
   meth->return_type = "void";
   meth->default_impl.type = mit_undefined;
+  meth->default_impl.implemented_by = protocol_name;
   meth->fields = NULL;
   meth->next = methods;
   meth->is_implicit = 0;
+  meth->calls = 0;
+  meth->dominant = NULL;
   methods = meth;
 
   /* Read method information */
@@ -251,6 +411,9 @@ static void read_protocol_method(yaml_parser_t* parser,
   FORYMAP(parser, evt) {
     read_protocol_method_decl(parser, meth, &evt);
   }
+
+  if (mit_structural_equals == meth->default_impl.type)
+    check_structural_equals(meth, key);
 }
 
 static const struct {
@@ -271,6 +434,9 @@ static const struct {
   { "undefined", mit_undefined },
   { "custom", mit_custom },
   { "graphviz", mit_graphviz },
+  { "structural hash", mit_structural_hash },
+  { "cached structural hash", mit_cached_structural_hash },
+  { "structural equals", mit_structural_equals },
   { NULL }
 };
 
@@ -351,6 +517,38 @@ static method_impl* get_default_implementations(void) {
   return impls;
 }
 
+/*
+  Adds an internal field to the given element for each cached structural hash
+  method it implements, unless it already has one (eg, because it was
+  inherited).
+ */
+static void add_hash_caches(element* elt) {
+  method* meth;
+  field* f;
+  unsigned i = 0;
+  char* name;
+
+  for (meth = methods; meth; meth = meth->next, ++i) {
+    if (mit_cached_structural_hash != elt->implementations[i].type)
+      continue;
+
+    name = xmalloc(strlen(meth->name) + sizeof("__cache"));
+    sprintf(name, "_%s_cache", meth->name);
+
+    for (f = elt->members; f && strcmp(name, f->name); f = f->next);
+    if (f) {
+      free(name);
+      continue;
+    }
+
+    f = xmalloc(sizeof(field));
+    f->name = name;
+    f->type = meth->return_type;
+    f->next = elt->members;
+    elt->members = f;
+  }
+}
+
 static void read_element_decl(yaml_parser_t* parser, element* elt,
                               yaml_event_t* key);
 static void read_element(yaml_parser_t* parser, yaml_event_t* key) {
@@ -389,6 +587,8 @@ static void read_element(yaml_parser_t* parser, yaml_event_t* key) {
     read_element_decl(parser, elt, &evt);
   }
 
+  add_hash_caches(elt);
+
   /* Add padding to long alignment to ensure binary compatibility */
   padding = xmalloc(sizeof(field));
   padding->type = "long";
@@ -467,7 +667,7 @@ static void read_element_fields(yaml_parser_t* parser,
   yaml_event_t nameevt;
   const char* name;
   field* f;
-  char message[64];
+  char message[128];
 
   xyp_parse(&nameevt, parser);
   EXPECT(nameevt, YAML_MAPPING_START_EVENT);
@@ -490,6 +690,25 @@ static void read_element_fields(yaml_parser_t* parser,
     f->next = this->members;
     read_string_value(&f->type, parser);
     this->members = f;
+
+    /* A sequence's items are copied in from the builder passed to the
+     * constructor, so there is nothing to initialise an internal one from.
+     */
+    if (('_' == name[0] || ':' == name[0]) && is_protocol_sequence(f->type)) {
+      snprintf(message, sizeof(message),
+               "Sequence field %s cannot be internal", name);
+      format_error(message, &nameevt);
+    }
+
+    /* Snapshots can't store arbitrary pointers; make sure there's a
+     * serializer for any such field that would need to be saved.
+     */
+    if (generate_snapshots && '_' != name[0] &&
+        is_opaque(f->type) && !find_serializer(f->type)) {
+      snprintf(message, sizeof(message),
+               "No serializer for type %s of field %s", f->type, name);
+      format_error(message, &nameevt);
+    }
   }
 }
 
@@ -519,9 +738,17 @@ static void read_element_methods(yaml_parser_t* parser,
     }
 
     read_method_impl(this->implementations + i, parser, this->name);
+    if (mit_structural_equals == this->implementations[i].type)
+      check_structural_equals(meth, &nameevt);
   }
 }
 
+static void read_element_interned(yaml_parser_t* parser,
+                                  element* this,
+                                  yaml_event_t* key) {
+  read_boolean_value(&this->is_interned, parser);
+}
+
 static const struct {
   const char* name;
   void (*parse)(yaml_parser_t*, element*, yaml_event_t*);
@@ -529,6 +756,7 @@ static const struct {
   { "extends", read_element_extends },
   { "fields", read_element_fields },
   { "methods", read_element_methods },
+  { "interned", read_element_interned },
   { NULL },
 };
 
@@ -575,6 +803,17 @@ static int matches_section(unsigned* increment,
   }
 }
 
+/* Elements are prepended as they are read, so their positions in the list
+ * are only known once all have been.
+ */
+static void number_elements(void) {
+  element* elt;
+  unsigned ix = 0;
+
+  for (elt = elements; elt; elt = elt->next)
+    elt->index = ix++;
+}
+
 void read_input_file(yaml_parser_t* parser) {
   yaml_event_t evt;
   unsigned stage = 0, incr;
@@ -607,4 +846,5 @@ void read_input_file(yaml_parser_t* parser) {
   }
 
   end_document(parser, &evt);
+  number_elements();
 }